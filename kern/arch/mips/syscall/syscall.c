@@ -85,6 +85,8 @@ syscall(struct trapframe *tf)
 	uint32_t retval2;
 	uint64_t ar2,ret;
 	int whence;
+	int mmap_fd;
+	off_t mmap_offset;
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -114,6 +116,11 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 		/**
 		 * Added by Babu : case statements for process related syscalls
 		 */
@@ -194,6 +201,44 @@ syscall(struct trapframe *tf)
         case SYS_remove:
         		err = sys_remove((userptr_t)tf->tf_a0);
         		break;
+
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_mmap:
+		/* fd and the 64-bit offset are on the stack */
+		err = copyin((const_userptr_t)(tf->tf_sp+16), &mmap_fd,
+			     sizeof(mmap_fd));
+		if (err) {
+			break;
+		}
+		err = copyin((const_userptr_t)(tf->tf_sp+24), &mmap_offset,
+			     sizeof(mmap_offset));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			       (int)tf->tf_a2, (int)tf->tf_a3, mmap_fd,
+			       mmap_offset, &retval);
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
+	    case SYS_msync:
+		err = sys_msync((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1,
+				(int)tf->tf_a2);
+		break;
+
+	    case SYS_sync:
+		err = sys_sync();
+		break;
+
+	    case SYS_vmstat:
+		err = sys_vmstat((userptr_t)tf->tf_a0);
+		break;
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
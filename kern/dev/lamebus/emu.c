@@ -51,6 +51,7 @@
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <vm.h>
 #include <emufs.h>
 #include "autoconf.h"
 
@@ -477,6 +478,15 @@ emufs_reclaim(struct vnode *v)
 	 */
 
 	vfs_biglock_acquire();
+
+	/*
+	 * Write back and drop whatever the VM page cache has of the
+	 * file, before taking e_lock, which writing back needs.
+	 */
+	if (ev->ev_v.vn_refcount == 1) {
+		pagecache_purge(v);
+	}
+
 	lock_acquire(ef->ef_emu->e_lock);
 
 	if (ev->ev_v.vn_refcount != 1) {
@@ -583,9 +593,11 @@ int
 emufs_write(struct vnode *v, struct uio *uio)
 {
 	struct emufs_vnode *ev = v->vn_data;
+	off_t pos = uio->uio_offset;
+	size_t resid = uio->uio_resid;
 	uint32_t amt;
 	size_t oldresid;
-	int result;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
@@ -599,7 +611,7 @@ emufs_write(struct vnode *v, struct uio *uio)
 
 		result = emu_write(ev->ev_emu, ev->ev_handle, amt, uio);
 		if (result) {
-			return result;
+			break;
 		}
 
 		if (uio->uio_resid == oldresid) {
@@ -608,7 +620,10 @@ emufs_write(struct vnode *v, struct uio *uio)
 		}
 	}
 
-	return 0;
+	/* Bring the VM page cache up to date with what got written. */
+	pagecache_invalidate(v, pos, resid - uio->uio_resid);
+
+	return result;
 }
 
 /*
@@ -717,7 +732,16 @@ int
 emufs_truncate(struct vnode *v, off_t len)
 {
 	struct emufs_vnode *ev = v->vn_data;
-	return emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	int result;
+
+	result = emu_trunc(ev->ev_emu, ev->ev_handle, len);
+	if (result) {
+		return result;
+	}
+
+	/* Cached pages must not show what was past the new EOF. */
+	pagecache_truncate(v, len);
+	return 0;
 }
 
 /*
@@ -837,13 +861,17 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * The VM system maps file pages through its page cache, which reads
+ * and writes them with VOP_READ and VOP_WRITE, so files can be mapped;
+ * this is also what lets programs on emufs be paged in as they run.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
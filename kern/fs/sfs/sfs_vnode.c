@@ -44,11 +44,20 @@
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
+#include <slab.h>
+#include <vm.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/*
+ * In-memory vnodes come from their own cache, packed at their exact
+ * size rather than in the 1k kmalloc blocks they would round up to.
+ * sfs_loadvnode makes it on first use, under vfs_biglock.
+ */
+static struct kmem_cache *sfs_vnode_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -910,6 +919,9 @@ sfs_reclaim(struct vnode *v)
 		return EBUSY;
 	}
 
+	/* Write back and drop whatever the VM page cache has of the file. */
+	pagecache_purge(v);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
 		result = VOP_TRUNCATE(&sv->sv_v, 0);
@@ -953,7 +965,7 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_release();
 
 	/* Release the storage for the vnode structure itself. */
-	kfree(sv);
+	kmem_cache_free(sfs_vnode_cache, sv);
 
 	/* Done */
 	return 0;
@@ -986,6 +998,8 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t pos = uio->uio_offset;
+	size_t resid = uio->uio_resid;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
@@ -994,6 +1008,12 @@ sfs_write(struct vnode *v, struct uio *uio)
 	result = sfs_io(sv, uio);
 	vfs_biglock_release();
 
+	/*
+	 * Whatever got written, even if not all of it did, replaces what
+	 * the VM page cache has of that part of the file.
+	 */
+	pagecache_invalidate(v, pos, resid - uio->uio_resid);
+
 	return result;
 }
 
@@ -1110,14 +1130,16 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). The VM system maps file pages through its page
+ * cache, which reads and writes them with VOP_READ and VOP_WRITE, so
+ * all there is to say is that regular files may be mapped.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
@@ -1221,6 +1243,10 @@ sfs_truncate(struct vnode *v, off_t len)
 	sv->sv_dirty = true;
 
 	vfs_biglock_release();
+
+	/* Cached pages must not show what was past the new EOF. */
+	pagecache_truncate(v, len);
+
 	return 0;
 }
 
@@ -1376,6 +1402,11 @@ sfs_remove(struct vnode *dir, const char *name)
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+
+		/* Don't let the VM keep a removed program around. */
+		if (victim->sv_i.sfi_linkcount == 0) {
+			pagecache_unkeep(&victim->sv_v);
+		}
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
@@ -1685,7 +1716,21 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	/* Didn't have it loaded; load it */
 
-	sv = kmalloc(sizeof(struct sfs_vnode));
+	/*
+	 * No constructor: nothing in an sfs_vnode outlives a load (the
+	 * vnode has no lock of its own; the big VFS lock covers it),
+	 * so the cache is only for packing them at their exact size.
+	 */
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	sv = kmem_cache_alloc(sfs_vnode_cache);
 	if (sv==NULL) {
 		return ENOMEM;
 	}
@@ -1699,7 +1744,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1736,7 +1781,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -1747,7 +1792,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
+		kmem_cache_free(sfs_vnode_cache, sv);
 		return result;
 	}
 
@@ -35,10 +35,12 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct cpu;
 
 
 /* 
@@ -47,18 +49,68 @@ struct vnode;
  *
  * You write this.
  */
+/*
+ * Two-level page table, split the way the MIPS would split it: the top
+ * 10 bits of a user address pick one of PT_NENTRIES second-level
+ * tables and the next 10 bits pick a PTE in it. A second-level table
+ * is only allocated once something in its 4M of address space is
+ * touched, so sparse programs pay for what they use.
+ */
+#define PT_NENTRIES        1024
+#define PT_DIR_INDEX(va)   (((va) >> 22) & (PT_NENTRIES - 1))
+#define PT_TABLE_INDEX(va) (((va) >> 12) & (PT_NENTRIES - 1))
+#define PT_VADDR(d, t)     (((vaddr_t)(d) << 22) | ((vaddr_t)(t) << 12))
+
+/* Page table entry: physical frame number plus flag bits */
+typedef uint32_t pte_t;
+
+#define PTE_FRAME   0xfffff000	/* physical address of the frame */
+#define PTE_VALID   0x00000001	/* frame is resident */
+#define PTE_SWAPPED 0x00000002	/* not resident; frame bits hold a swap slot */
+
+#define PTE_SLOT(pte)     ((uint32_t)(pte) >> 12)
+#define PTE_MKSWAP(slot)  (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
 struct pagetable{
-	vaddr_t viraddress;
-	paddr_t phyaddress;
-	struct pagetable *next;
+	pte_t *pt_tables[PT_NENTRIES];
 };
 
+/*
+ * A region of the program, or a mapping of a file made by mmap. prot
+ * holds the PROT_ bits it may be accessed with. If vn is set, the
+ * region's pages come from that file (with a reference held): offset
+ * is the file offset viraddress maps, and the first filesize bytes of
+ * the region are in the file while the rest is zero-filled. A mapping
+ * has mmapped set and is all file; shared is set for MAP_SHARED. A
+ * program region is a private mapping of its segment in the
+ * executable, or has no vn if it had to be copied in by load_elf.
+ */
 struct region{
 	vaddr_t viraddress;
 	size_t numpages;
-	struct region *next;
+	struct vnode *vn;
+	off_t offset;
+	size_t filesize;
+	int prot;
+	bool shared;
+	bool mmapped;
 };
 
+/*
+ * Array of regions. An address space keeps its regions in one, sorted
+ * by viraddress and not overlapping, so that the region an address
+ * lies in is found by binary search.
+ */
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region);
+DEFARRAY(region, ASINLINE);
+
+/* Pages of user stack; they are only allocated when touched */
+#define VM_STACKPAGES 1024
+
 struct addrspace {
 #if OPT_DUMBVM
         vaddr_t as_vbase1;
@@ -70,12 +122,31 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
-        struct region *reg;
+        struct regionarray *regions;
+        struct region *lastregion;	/* last one as_find_region found */
+        bool loading;			/* in load_elf: all regions writeable */
         struct pagetable *table;
         vaddr_t sbase;
         vaddr_t stop;
         vaddr_t hbase;
         vaddr_t htop;
+
+        /*
+         * Sequential fault detection for prefetching: the page a fault
+         * in the current run should hit next, and how many faults the
+         * run has had. See vm_fault.
+         */
+        vaddr_t seqnext;
+        unsigned seqrun;
+
+        /*
+         * TLB entries are tagged with asid. It is only good while
+         * asid_generation is current and we stay on asid_cpu; see
+         * vm_activate.
+         */
+        uint32_t asid;
+        uint32_t asid_generation;
+        struct cpu *asid_cpu;
 #endif
 };
 
@@ -102,6 +173,12 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_map_segment - make the region a segment was defined as map the
+ *                segment from the executable VN, FILESZ bytes of it
+ *                from OFFSET, so that it is paged in on demand. Fails
+ *                with EINVAL if it cannot be; load_elf copies the
+ *                segment in then.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -111,6 +188,30 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_valid_addr - true if VADDR lies in a region, the heap or the
+ *                stack of the address space.
+ *
+ *    as_find_region - return the region (or file mapping) VADDR lies
+ *                in, or NULL. O(log n) in the number of regions, and
+ *                O(1) if it is the same one as last time.
+ *
+ *    as_heaplimit - return how far the heap may grow: up to the lowest
+ *                file mapping, or the stack.
+ *
+ *    as_map_file - map LEN bytes (a whole number of pages) of VN from
+ *                OFFSET between the heap and the stack, and hand back
+ *                where in *RET.
+ *
+ *    as_unmap  - remove the file mappings in a range of pages, writing
+ *                back what shared ones changed.
+ *
+ *    as_sync   - write back what shared file mappings in a range of
+ *                pages changed.
+ *
+ *    pt_lookup - return the PTE for VADDR, allocating the second-level
+ *                table if CREATE is set. Returns NULL if there is no
+ *                table (or no memory for one).
  */
 
 struct addrspace *as_create(void);
@@ -123,9 +224,22 @@ int               as_define_region(struct addrspace *as,
                                    int readable, 
                                    int writeable,
                                    int executable);
+int               as_map_segment(struct addrspace *as, vaddr_t vaddr,
+                                 size_t memsz, struct vnode *vn,
+                                 off_t offset, size_t filesz);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+bool              as_valid_addr(struct addrspace *as, vaddr_t vaddr);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+vaddr_t           as_heaplimit(struct addrspace *as);
+int               as_map_file(struct addrspace *as, size_t len,
+                              struct vnode *vn, off_t offset,
+                              int prot, bool shared, vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_sync(struct addrspace *as, vaddr_t vaddr, size_t len);
+
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
 
 
 /*
@@ -137,5 +251,16 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
+/*
+ * Functions in vm.c that work on page table entries. Another thread may
+ * be evicting the page a PTE maps, so PTEs of a live address space are
+ * only changed through these (or by vm_fault).
+ *    pte_free  - drop the frame or swap slot PTE refers to and clear it.
+ *    pte_share - make NEWPTE map whatever OLDPTE maps, copy-on-write.
+ */
+
+void pte_free(pte_t *pte);
+void pte_share(pte_t *oldpte, pte_t *newpte);
+
 
 #endif /* _ADDRSPACE_H_ */
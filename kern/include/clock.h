@@ -38,8 +38,8 @@
  * hardclock() is called on every CPU HZ times a second, possibly only
  * when the CPU is not idle, for scheduling.
  *
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timerclock() is called on one CPU once a second. Timed operations
+ * use timeouts instead (see <timeout.h>), which hardclock() runs.
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -69,9 +69,11 @@ void getinterval(time_t secs1, uint32_t nsecs,
 
 /*
  * clocksleep() suspends execution for the requested number of seconds,
- * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ * like userlevel sleep(3); clocksleep_ticks() for a number of
+ * hardclocks. (Don't confuse them with wchan_sleep.)
  */
 void clocksleep(int seconds);
+void clocksleep_ticks(unsigned ticks);
 
 
 #endif /* _CLOCK_H_ */
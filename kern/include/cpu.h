@@ -33,6 +33,8 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <runqueue.h>
+#include <timeout.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -59,16 +61,28 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_freethreads; /* Exited threads kept for reuse */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_nvcsw;		/* Voluntary context switches */
+	unsigned c_nivcsw;		/* Involuntary context switches */
+	uint32_t c_asid;		/* Address space ID loaded in the MMU */
+	uint32_t c_asid_generation;	/* ASID generation of our TLB */
 
 	/*
 	 * Accessed by other cpus.
-	 * Protected by the runqueue lock.
+	 * Protected by the runqueue lock, except that the run queue's
+	 * count may be read without it (see runqueue.h).
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct runqueue c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus.
+	 * Protected by its own lock.
+	 */
+	struct timewheel c_timers;	/* Timeouts set on this cpu */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -82,10 +96,17 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * The mappings that did not fit are covered by the full flush,
+	 * but their senders still wait to hear back: c_shootdown_owed
+	 * counts the V()s owed to each of c_shootdown_sems, done after
+	 * the flush.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	struct semaphore *c_shootdown_sems[TLBSHOOTDOWN_MAX];
+	unsigned c_shootdown_owed[TLBSHOOTDOWN_MAX];
 	struct spinlock c_ipi_lock;
 };
 
@@ -152,6 +173,7 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch queues several mappings and sends one IPI.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +188,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(struct cpu *target,
+			    const struct tlbshootdown *mappings,
+			    unsigned nmappings);
 
 void interprocessor_interrupt(void);
 
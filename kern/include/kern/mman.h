@@ -0,0 +1,26 @@
+/*
+ * mman.h
+ *
+ *	Constants for mmap(), munmap() and msync().
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/* Protections: PROT_NONE, or any of the others or'd together */
+#define PROT_NONE       0
+#define PROT_READ       1
+#define PROT_WRITE      2
+#define PROT_EXEC       4
+
+/* Mapping flags: choose one of these */
+#define MAP_SHARED      1      /* Writes go to the file */
+#define MAP_PRIVATE     2      /* Writes go to a private copy */
+#define MAP_TYPE        3      /* mask for MAP_SHARED/MAP_PRIVATE */
+
+/* Flags for msync */
+#define MS_ASYNC        1      /* Schedule the writes (done at once here) */
+#define MS_SYNC         2      /* Write back before returning */
+#define MS_INVALIDATE   4      /* Drop other cached copies (no-op here) */
+
+#endif /* _KERN_MMAN_H_ */
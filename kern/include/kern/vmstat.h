@@ -0,0 +1,37 @@
+/*
+ * vmstat.h
+ *
+ *	Virtual memory statistics, for vmstat() and the kernel menu.
+ */
+
+#ifndef _KERN_VMSTAT_H_
+#define _KERN_VMSTAT_H_
+
+struct vmstats {
+	/* Events since boot, summed over all CPUs */
+	__u32 vs_faults_read;		/* TLB misses on loads */
+	__u32 vs_faults_write;		/* TLB misses on stores */
+	__u32 vs_faults_readonly;	/* stores through read-only entries */
+	__u32 vs_tlb_refills;		/* TLB entries loaded for faults */
+	__u32 vs_tlb_preloads;		/* loaded ahead by fault-around */
+	__u32 vs_zerofills;		/* pages given a zero-filled frame */
+	__u32 vs_zeromaps;		/* reads mapping the shared zero page */
+	__u32 vs_cowcopies;		/* pages copied on write */
+	__u32 vs_pcache_hits;		/* file pages found in the page cache */
+	__u32 vs_pcache_misses;		/* file pages read in */
+	__u32 vs_prefetches;		/* pages read in by prefetching */
+	__u32 vs_evictions;		/* pages evicted */
+	__u32 vs_swapins;		/* pages read from swap */
+	__u32 vs_swapouts;		/* pages written to swap */
+
+	/* Physical pages right now, by coremap state */
+	__u32 vs_pages_total;		/* all pages the coremap covers */
+	__u32 vs_pages_free;		/* in the free lists */
+	__u32 vs_pages_zeroed;		/* free and zeroed, in the zero pool */
+	__u32 vs_pages_fixed;		/* the coremap itself, the zero page */
+	__u32 vs_pages_dirty;		/* in use, no copy on disk */
+	__u32 vs_pages_clean;		/* in use, copy in swap or the file */
+	__u32 vs_pages_cached;		/* in the page cache (dirty or clean) */
+};
+
+#endif /* _KERN_VMSTAT_H_ */
@@ -0,0 +1,65 @@
+/*
+ * runqueue.h
+ *
+ *	Per-CPU queues of runnable threads.
+ */
+
+#ifndef _RUNQUEUE_H_
+#define _RUNQUEUE_H_
+
+#include <threadlist.h>
+#include "opt-mlfq.h"
+
+struct thread;	/* from <thread.h> */
+
+/*
+ * With the MLFQ scheduler (options mlfq) there is one list per
+ * priority level, 0 being the highest, and a bitmap of the levels that
+ * have threads on them, so that the next thread to run is found in
+ * constant time. A thread is queued on the level in its priority
+ * field. Otherwise it is one list, which the old scheduler reorders
+ * by priority.
+ *
+ * The CPU's c_runqueue_lock protects its run queue. rq_count is only
+ * changed with the lock held, but other CPUs read it without, as a
+ * cheap and possibly stale measure of how busy this one is.
+ */
+#define RUNQ_LEVELS 8
+
+struct runqueue {
+#if OPT_MLFQ
+	struct threadlist rq_levels[RUNQ_LEVELS];
+	uint32_t rq_nonempty;		/* bit L set if level L has threads */
+#else
+	struct threadlist rq_list;
+#endif
+	volatile unsigned rq_count;	/* threads on all levels */
+};
+
+/*
+ * Operations:
+ *    runqueue_init     - initialize, empty.
+ *    runqueue_cleanup  - clean up. Must be empty.
+ *    runqueue_isempty  - true if there are no threads on it.
+ *    runqueue_add      - put T at the back of its level.
+ *    runqueue_remhead  - take the thread to run next: the one waiting
+ *                        longest on the highest level. NULL if empty.
+ *    runqueue_remtail  - take the thread that would run last (for
+ *                        migration). NULL if empty.
+ *    runqueue_preempts - true if a queued thread should run before T
+ *                        would, if T were queued now.
+ *    runqueue_outranks - true if a queued thread is on a higher level
+ *                        than T. Never, without levels.
+ *    runqueue_boost    - move every thread to the highest level.
+ */
+void runqueue_init(struct runqueue *rq);
+void runqueue_cleanup(struct runqueue *rq);
+bool runqueue_isempty(struct runqueue *rq);
+void runqueue_add(struct runqueue *rq, struct thread *t);
+struct thread *runqueue_remhead(struct runqueue *rq);
+struct thread *runqueue_remtail(struct runqueue *rq);
+bool runqueue_preempts(struct runqueue *rq, struct thread *t);
+bool runqueue_outranks(struct runqueue *rq, struct thread *t);
+void runqueue_boost(struct runqueue *rq);
+
+#endif /* _RUNQUEUE_H_ */
@@ -0,0 +1,49 @@
+/*
+ * slab.h
+ *
+ *	Object caches for kernel structures allocated and freed often.
+ */
+
+#ifndef SLAB_H_
+#define SLAB_H_
+
+/*
+ * A kmem_cache hands out objects of one type, packed into pages
+ * ("slabs") at their exact size instead of the next kmalloc size up.
+ *
+ * Objects can keep expensive state across reuse. The optional
+ * constructor runs only when an object is first handed out, and the
+ * destructor only when its slab goes back to the VM system; in between,
+ * kmem_cache_free leaves the object as it is, so it must be freed in
+ * the state the constructor leaves it in (e.g. its lock created and
+ * not held). Fields that need fresh values each time are up to the
+ * caller, as with kmalloc.
+ *
+ * The constructor returns 0 or an error code; if it fails, the
+ * allocation fails and returns NULL.
+ *
+ * Functions in slab.c:
+ *
+ *    kmem_cache_create  - make a cache of objects SIZE bytes long.
+ *                         CTOR and DTOR may be NULL.
+ *
+ *    kmem_cache_destroy - destroy a cache. All its objects must have
+ *                         been freed.
+ *
+ *    kmem_cache_alloc   - get an object, or NULL if out of memory.
+ *
+ *    kmem_cache_free    - give an object back to the cache it came from.
+ *
+ *    kmem_cache_printstats - print usage of every cache.
+ */
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     int (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+void kmem_cache_printstats(void);
+
+#endif /* SLAB_H_ */
@@ -0,0 +1,48 @@
+/*
+ * swap.h
+ *
+ *	Swap space for evicted user pages.
+ */
+
+#ifndef SWAP_H_
+#define SWAP_H_
+
+/*
+ * Swap lives on its own disk, addressed through the raw device, in
+ * page-sized slots. A slot is written once, when a dirty page is
+ * evicted, and after that only read, so several page tables can share
+ * it: fork shares swapped-out pages copy-on-write just like resident
+ * ones, and each slot counts its references.
+ */
+#define SWAP_DEVICE  "lhd1raw:"
+#define SWAP_NOSLOT  ((uint32_t)-1)
+
+/*
+ * Functions in swap.c:
+ *
+ *    swap_bootstrap - open the swap disk. If there is none, paging is
+ *                     disabled and running out of memory fails with
+ *                     ENOMEM as it always did.
+ *
+ *    swap_enabled   - true if there is a swap disk.
+ *
+ *    swap_alloc     - claim a free slot with one reference. Returns
+ *                     ENOSPC if swap is full.
+ *
+ *    swap_share     - take another reference to a slot.
+ *
+ *    swap_free      - drop a reference; the last one frees the slot.
+ *
+ *    swap_in        - read a slot into the frame at PADDR.
+ *
+ *    swap_out       - write the frame at PADDR to a slot.
+ */
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int  swap_alloc(uint32_t *slot);
+void swap_share(uint32_t slot);
+void swap_free(uint32_t slot);
+int  swap_in(uint32_t slot, paddr_t paddr);
+int  swap_out(uint32_t slot, paddr_t paddr);
+
+#endif /* SWAP_H_ */
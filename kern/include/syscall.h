@@ -35,6 +35,7 @@
 
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct fTable; /* from <thread.h> */
 
 /*
  * The system call dispatcher.
@@ -53,6 +54,14 @@ void enter_forked_process(struct trapframe *tf);
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
+/*
+ * Open file table entries: set up their cache, and get a blank one
+ * (with its lock created, and not held) or give one back.
+ */
+void ftable_bootstrap(void);
+struct fTable *ftable_create(void);
+void ftable_destroy(struct fTable *f);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -60,6 +69,7 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
 int open(userptr_t filename, int flags,int *err);
 int close(int fd);
 int read(int fd, userptr_t buf, size_t buflen,int *err);
@@ -69,4 +79,11 @@ off_t lseek(int fd,off_t pos, int whence, int *err);
 int chdir(const_userptr_t pathname);
 int __getcwd(userptr_t buf, size_t buflen,int *err);
 int sys_remove(userptr_t p);
+int sys_sbrk(intptr_t amount, int32_t *retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int32_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_msync(vaddr_t addr, size_t len, int flags);
+int sys_sync(void);
+int sys_vmstat(userptr_t buf);
 #endif /* _SYSCALL_H_ */
@@ -90,6 +90,7 @@ void stoplight_cleanup(void);
 int arraytest(int, char **);
 int bitmaptest(int, char **);
 int queuetest(int, char **);
+int slabtest(int, char **);
 
 /* thread tests */
 int threadtest(int, char **);
@@ -99,6 +100,7 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int timeouttest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -111,6 +113,7 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int pagebench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
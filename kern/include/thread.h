@@ -83,6 +83,7 @@ struct thread {
 	 */
 	char *t_name;			/* Name of this thread */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
+	struct wchan *t_wchan;		/* Wait channel, while on its list */
 	threadstate_t t_state;		/* State this thread is in */
 
 	/*
@@ -130,7 +131,11 @@ struct thread {
 
 	/* add more here as needed */
 	struct fTable *ft[OPEN_MAX];          /*File table pointer*/
-	int priority;
+	int priority;			/* MLFQ level; 0 is the highest */
+	unsigned t_usage;		/* clock ticks used at this level */
+	unsigned t_slice;		/* clock ticks left in this turn */
+	unsigned t_nvcsw;		/* voluntary context switches */
+	unsigned t_nivcsw;		/* involuntary context switches */
 };
 
 
@@ -173,11 +178,39 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Make the current thread give up the cpu, but stay runnable. Like
+ * thread_yield, but counted as an involuntary switch. Called from the
+ * timer interrupt.
+ */
+void thread_preempt(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Charge the current thread for a clock tick. Returns true if it
+ * should now be preempted. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
+/*
+ * Time slice length, in hardclocks, for each scheduling class. Classes
+ * are numbered from 0 to thread_numclasses()-1; with the MLFQ scheduler
+ * they are the run queue levels. thread_setquantum returns EINVAL for
+ * a bad class or length.
+ */
+unsigned thread_numclasses(void);
+unsigned thread_getquantum(unsigned class);
+int thread_setquantum(unsigned class, unsigned ticks);
+
+/*
+ * Print the time slices and context switch counts.
+ */
+void thread_printstats(void);
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
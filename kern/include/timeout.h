@@ -0,0 +1,66 @@
+/*
+ * timeout.h
+ *
+ *	Timed callbacks, on a hashed timer wheel per cpu.
+ */
+
+#ifndef _TIMEOUT_H_
+#define _TIMEOUT_H_
+
+#include <spinlock.h>
+
+/*
+ * A timeout calls TO_FUNC(TO_ARG) from hardclock() on the cpu it was
+ * set on, a given number of hardclocks (see HZ in <clock.h>) after it
+ * was set. The function runs in the timer interrupt, so it may not
+ * sleep; it may take spinlocks and wake threads.
+ *
+ * The caller provides the struct timeout, which is not copied, and
+ * must not free it while it is pending or its function is running;
+ * timeout_cancel waits for the latter.
+ */
+struct timeout {
+	struct timeout *to_next;	/* next in the wheel slot */
+	struct timeout **to_prevp;	/* what points at us; NULL if idle */
+	struct timewheel *to_wheel;	/* wheel last set on */
+	unsigned to_expires;		/* wheel tick it is due on */
+	void (*to_func)(void *arg);
+	void *to_arg;
+};
+
+/*
+ * The wheel has one list per slot, hashed by the tick a timeout is due
+ * on, so setting and cancelling one take constant time and each tick
+ * looks at one slot. Timeouts more than TIMEWHEEL_SLOTS ticks away
+ * share slots with nearer ones and are passed over until their turn.
+ */
+#define TIMEWHEEL_SLOTS	256	/* must be a power of 2 */
+
+struct timewheel {
+	struct spinlock tw_lock;
+	unsigned tw_now;		/* ticks so far */
+	struct timeout *tw_running;	/* timeout whose function is running */
+	struct timeout *tw_slots[TIMEWHEEL_SLOTS];
+};
+
+/*
+ * Operations:
+ *    timewheel_init - initialize a wheel, empty.
+ *    timewheel_tick - advance a wheel by one tick and call what is due.
+ *                     Called from hardclock() on curcpu's wheel.
+ *    timeout_init   - set up a timeout to call FUNC(ARG).
+ *    timeout_set    - have the timeout go off TICKS ticks from now (at
+ *                     least 1), from the current cpu. It must not be
+ *                     pending.
+ *    timeout_cancel - stop the timeout if it is pending, and wait for
+ *                     its function if it is running. Returns true if
+ *                     it was stopped before going off.
+ */
+void timewheel_init(struct timewheel *tw);
+void timewheel_tick(struct timewheel *tw);
+
+void timeout_init(struct timeout *to, void (*func)(void *), void *arg);
+void timeout_set(struct timeout *to, unsigned ticks);
+bool timeout_cancel(struct timeout *to);
+
+#endif /* _TIMEOUT_H_ */
@@ -39,17 +39,28 @@
 
 #include <machine/vm.h>
 
+struct addrspace;
+struct thread;
+struct vnode;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
+/*
+ * DIRTY pages have no up-to-date copy in swap; CLEAN ones were paged in
+ * and not written since, so swap_slot still holds their contents and
+ * evicting them costs no disk write. ZEROED pages are free and already
+ * zero-filled, waiting in the zero pool.
+ */
 enum page_state
 {
 	FREE,
 	FIXED,
 	DIRTY,
-	CLEAN
+	CLEAN,
+	ZEROED
 };
 
 /**
@@ -60,8 +71,12 @@ enum page_state
  */
 struct page
 {
-	// Address space
+	// Owning address space and the user address the page is mapped
+	// at, so eviction can find the PTE. NULL for kernel pages, and for
+	// user pages whose owner is not known (after copy-on-write sharing
+	// ends) until the next fault on them claims them again.
 	struct addrspace *addrspce;
+	vaddr_t user_vaddr;
 
 	// Virtual Address
 	vaddr_t virtual_addr;
@@ -72,11 +87,53 @@ struct page
 	// Incase of n-continuous page allocation store that information also
 	int32_t num_pages;
 
-	// For FIFO- Paging algorithm
-	uint64_t timestamp;
+	// Swap slot holding a copy of a CLEAN page, else SWAP_NOSLOT
+	uint32_t swap_slot;
+
+	// Clock replacement: set whenever the page is loaded into the TLB
+	bool referenced;
+
+	// Being paged in, paged out or copied; its PTE must be left alone
+	// until this clears (wait on the coremap wait channel)
+	bool busy;
+
+	// Number of page table entries mapping this frame; a frame
+	// shared copy-on-write after fork has more than one
+	int32_t refcount;
+
+	// Buddy allocator : order of the free block this page heads
+	// (PAGE_NOORDER if it is not the head of a free block) and the
+	// links of the per-order free list the block is on
+	int32_t order;
+	struct page *next_free;
+	struct page *prev_free;
+
+	// Kernel heap : kmalloc's bookkeeping for a page it carved into
+	// blocks, so kfree can find it without a search; NULL otherwise
+	void *kheap_tag;
+
+	// Page cache : the file page this frame holds (vnode is NULL if
+	// it holds none) and the next page on its hash chain. The cache
+	// has a reference of its own, so refcount is one more than the
+	// number of page table entries mapping the frame. DIRTY and CLEAN
+	// are with respect to the file rather than swap.
+	struct vnode *vnode;
+	off_t file_offset;
+	struct page *next_cached;
+
+	// Thread writing the page back to its file, while it does; the
+	// write it makes must not try to refresh the page from the file
+	struct thread *writer;
 
 };
 
+/*
+ * Largest block handed out by the buddy allocator is 2^PAGE_MAXORDER
+ * pages (4M with 4k pages).
+ */
+#define PAGE_MAXORDER 10
+#define PAGE_NOORDER  (-1)
+
 #define CME_SIZE (sizeof(struct page))
 
 // CoreMap
@@ -95,17 +152,91 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Tag a kernel heap page with kmalloc's bookkeeping for it, and look
+ * the tag up from any address in the page (NULL if untagged, or if the
+ * page is not managed by the coremap). Only the owner of the page sets
+ * or clears its tag, so neither call takes a lock.
+ */
+void kpage_settag(vaddr_t addr, void *tag);
+void *kpage_gettag(vaddr_t addr);
+
 /*Allocate/free user pages (called by malloc/free)*/
 vaddr_t page_alloc(void);
 vaddr_t page_nalloc(unsigned long npages);
 void page_free(vaddr_t addr);
 
-/*Make the page available by swapping or by flushing*/
-int32_t make_page_avail(struct page *page);
+/*
+ * Page cache of the file pages mmap maps, keyed by (vnode, offset).
+ * Dirty pages are only written back through these:
+ *    pagecache_writeback - write back the cached page of VN at OFFSET
+ *                if it is dirty. The caller must hold a reference to
+ *                VN (a mapping of it will do).
+ *    pagecache_sync - write back every dirty page that is mapped.
+ *    pagecache_purge - write back and drop every page of VN; called
+ *                when VN is reclaimed, so nothing maps it any more.
+ *    pagecache_invalidate - bring the cached pages of VN in the LEN
+ *                bytes at OFFSET up to date with the file; called by
+ *                VOP_WRITE once it has written them. Pages nothing
+ *                maps are dropped, mapped ones are read again.
+ *    pagecache_truncate - zero or drop the cached pages of VN past
+ *                LEN; called by VOP_TRUNCATE once it has truncated.
+ *    pagecache_keep - keep VN, and so its cached pages, after nothing
+ *                else uses it; called for each program exec runs. Only
+ *                the last few are kept.
+ *    pagecache_unkeep - stop keeping VN; called when its last link
+ *                goes, and by pagecache_invalidate and
+ *                pagecache_truncate, so that a program that is changed
+ *                is not held on to.
+ *    pagecache_forget - let go of every vnode pagecache_keep kept, so
+ *                that file systems can be unmounted.
+ */
+int pagecache_writeback(struct vnode *vn, off_t offset);
+int pagecache_sync(void);
+void pagecache_purge(struct vnode *vn);
+void pagecache_invalidate(struct vnode *vn, off_t offset, off_t len);
+void pagecache_truncate(struct vnode *vn, off_t len);
+void pagecache_keep(struct vnode *vn);
+void pagecache_unkeep(struct vnode *vn);
+void pagecache_forget(void);
+
+/* Idle loop hook: zero a free page ahead of time; false if none needed */
+bool vm_zero_idle(void);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/*
+ * Address space IDs (called by as_activate and as_copy): load the
+ * ASID of an address space into the MMU, assigning it one first if
+ * need be; drop every translation of an address space by giving it
+ * a new ASID.
+ */
+void vm_activate(struct addrspace *as);
+void vm_tlbflush(struct addrspace *as);
+
+/*
+ * TLB refill counter, and a switch to flush the TLB on every context
+ * switch as if there were no ASIDs (for the tlb benchmark).
+ */
+uint32_t vm_tlbrefills(void);
+void vm_setasids(bool enable);
+
+/*
+ * VM statistics (see <kern/vmstat.h>): fill in a struct vmstats, for
+ * the vmstat system call, or print them, for the vm menu command.
+ */
+struct vmstats;
+void vm_getstats(struct vmstats *st);
+void vm_printstats(void);
+
+/*
+ * Fault-around window and sequential prefetch depth, in pages. The
+ * window is rounded down to a power of two; 1 and 0 turn them off.
+ */
+void vm_setfaultaround(unsigned around, unsigned ahead);
+void vm_getfaultaround(unsigned *around, unsigned *ahead);
+
 
 #endif /* _VM_H_ */
@@ -71,6 +71,13 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but wake up on our own after TICKS hardclocks (see
+ * HZ in <clock.h>) if nobody else does. Returns 0 if awakened and
+ * ETIMEDOUT if the time ran out.
+ */
+int wchan_sleep_timeout(struct wchan *wc, unsigned ticks);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
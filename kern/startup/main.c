@@ -43,6 +43,7 @@
 #include <current.h>
 #include <synch.h>
 #include <vm.h>
+#include <swap.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
@@ -110,6 +111,7 @@ boot(void)
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	ftable_bootstrap();
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
@@ -122,6 +124,7 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	swap_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 
@@ -36,6 +36,8 @@
 #include <uio.h>
 #include <clock.h>
 #include <thread.h>
+#include <vm.h>
+#include <slab.h>
 #include <vfs.h>
 #include <sfs.h>
 #include <syscall.h>
@@ -267,6 +269,7 @@ cmd_sync(int nargs, char **args)
 	(void)nargs;
 	(void)args;
 
+	pagecache_sync();
 	vfs_sync();
 
 	return 0;
@@ -405,10 +408,155 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 	
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for measuring TLB refills. Runs a program twice: once
+ * flushing the TLB on every context switch, as happens without address
+ * space IDs, and once keeping each address space's entries across
+ * switches. Run something that switches a lot, like parallelvm.
+ */
+static
+int
+cmd_tlbbench(int nargs, char **args)
+{
+	static const char *const modes[2] = { "flush on switch", "ASIDs" };
+	char progname[128];
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs, refills;
+	uint64_t usecs;
+	int pass, result;
+
+	if (nargs < 2) {
+		kprintf("Usage: tlb program [arguments]\n");
+		return EINVAL;
+	}
+
+	/* drop the leading "tlb" */
+	args++;
+	nargs--;
+
+	/* runprogram may scribble on the name; keep a copy for pass 2 */
+	if (strlen(args[0]) >= sizeof(progname)) {
+		return ENAMETOOLONG;
+	}
+	strcpy(progname, args[0]);
+
+	for (pass = 0; pass < 2; pass++) {
+		strcpy(args[0], progname);
+		vm_setasids(pass == 1);
+
+		refills = vm_tlbrefills();
+		gettime(&s1, &ns1);
+		result = common_prog(nargs, args);
+		gettime(&s2, &ns2);
+		refills = vm_tlbrefills() - refills;
+		if (result) {
+			break;
+		}
+
+		getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+		usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+		kprintf("%-16s %10u TLB refills in %lu.%06lu s",
+			modes[pass], refills, (unsigned long)secs,
+			(unsigned long)(nsecs / 1000));
+		if (usecs > 0) {
+			kprintf(" (%lu/s)",
+				(unsigned long)((uint64_t)refills * 1000000
+						/ usecs));
+		}
+		kprintf("\n");
+	}
+
+	vm_setasids(true);
+	return result;
+}
+
+/*
+ * Command for the fault-around window and the sequential prefetch
+ * depth (see vm_fault). Prints them with no arguments; set both to 1
+ * and 0 to compare against plain one-page faults with the tlb command.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	unsigned around, ahead;
+
+	if (nargs > 3) {
+		kprintf("Usage: fa [window [prefetch]]\n");
+		return EINVAL;
+	}
+
+	vm_getfaultaround(&around, &ahead);
+	if (nargs > 1) {
+		around = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		ahead = atoi(args[2]);
+	}
+	if (nargs > 1) {
+		vm_setfaultaround(around, ahead);
+		vm_getfaultaround(&around, &ahead);
+	}
+
+	kprintf("Fault-around window %u pages, prefetch %u pages\n",
+		around, ahead);
+	return 0;
+}
+
+/*
+ * Command for the time slices. With one argument, sets the quantum of
+ * every scheduling class; with two, that of one class. Prints the
+ * quanta and the context switch counts either way.
+ */
+static
+int
+cmd_slice(int nargs, char **args)
+{
+	unsigned class, ticks;
+	int result;
+
+	if (nargs > 3) {
+		kprintf("Usage: slice [[class] ticks]\n");
+		return EINVAL;
+	}
+
+	if (nargs == 2) {
+		ticks = atoi(args[1]);
+		for (class=0; class<thread_numclasses(); class++) {
+			result = thread_setquantum(class, ticks);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	else if (nargs == 3) {
+		result = thread_setquantum(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			return result;
+		}
+	}
+
+	thread_printstats();
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -448,6 +596,8 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[fa]      Fault-around/prefetch     ",
+	"[slice]   Time slices               ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -467,8 +617,11 @@ cmd_opsmenu(int n, char **a)
 static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[bt]  Bitmap test                   ",
+	"[sl]  Object cache test             ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] Page allocator benchmark      ",
+	"[tlb] TLB refill benchmark (prog)   ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -479,6 +632,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy5] CV test 2             (1)     ",
+	"[to]  Timeout test                  ",
 	"[sp1] Whalematching Driver  (1)     ",
 	"[sp2] Stoplight Driver      (1)     ",
 	"[fs1] Filesystem test               ",
@@ -510,6 +664,7 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[vm] VM stats                       ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -550,6 +705,8 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "fa",		cmd_faultaround },
+	{ "slice",	cmd_slice },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -558,12 +715,16 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "vm",		cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
+	{ "sl",		slabtest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	pagebench },
+	{ "tlb",	cmd_tlbbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -576,6 +737,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy5",	cvtest2 },
+	{ "to",		timeouttest },
 	
 #if OPT_SYNCHPROBS
   /* synchronization problem tests */
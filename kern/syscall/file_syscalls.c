@@ -20,6 +20,72 @@
 #include <seek.h>
 #include <stat.h>
 #include <kern/errno.h>
+#include <slab.h>
+
+/*
+ * Open file table entries come from their own cache. An entry keeps
+ * its lock across reuse, so open() and close() do not create and
+ * destroy one every time.
+ */
+static struct kmem_cache *ftable_cache;
+
+static
+int
+ftable_ctor(void *obj)
+{
+	struct fTable *f = obj;
+
+	f->lock = lock_create("fTable");
+	if (f->lock == NULL)
+	{
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+ftable_dtor(void *obj)
+{
+	struct fTable *f = obj;
+
+	lock_destroy(f->lock);
+}
+
+void
+ftable_bootstrap(void)
+{
+	ftable_cache = kmem_cache_create("fTable", sizeof(struct fTable),
+					 ftable_ctor, ftable_dtor);
+	if (ftable_cache == NULL)
+	{
+		panic("ftable_bootstrap: Out of memory\n");
+	}
+}
+
+struct fTable *
+ftable_create(void)
+{
+	struct fTable *f;
+
+	f = kmem_cache_alloc(ftable_cache);
+	if (f == NULL)
+	{
+		return NULL;
+	}
+	f->name = NULL;
+	f->status = 0;
+	f->offset = 0;
+	f->ref_count = 0;
+	f->vn = NULL;
+	return f;
+}
+
+void
+ftable_destroy(struct fTable *f)
+{
+	kmem_cache_free(ftable_cache, f);
+}
 
 int
 open(userptr_t filename, int flags,int *err)
@@ -44,28 +110,19 @@ open(userptr_t filename, int flags,int *err)
 	{
 		if (curthread->ft[i] == NULL)
 		{
-			curthread->ft[i] = kmalloc(sizeof(struct fTable));
+			curthread->ft[i] = ftable_create();
 			if (curthread->ft[i] == NULL)
 			{
 				*err = ENOMEM;
 				return -1;
 			}
-			curthread->ft[i]->lock = lock_create(curthread->t_name);
-			if (curthread->ft[i]->lock == NULL)
-			{
-				kfree(curthread->ft[i]);
-				curthread->ft[i] = NULL;
-				*err = ENOMEM;
-				return -1;
-			}
 			curthread->ft[i]->offset=0;
 			curthread->ft[i]->ref_count=(curthread->ft[i]->ref_count) + 1;
 			curthread->ft[i]->status = flags;
 			iobuff = (char *)kmalloc(PATH_MAX*sizeof(char));
 			if (iobuff == NULL)
 			{
-				lock_destroy(curthread->ft[i]->lock);
-				kfree(curthread->ft[i]);
+				ftable_destroy(curthread->ft[i]);
 				curthread->ft[i] = NULL;
 				*err = ENOMEM;
 				return -1;
@@ -74,8 +131,7 @@ open(userptr_t filename, int flags,int *err)
 			if(rFlag)
 			{
 				kfree(iobuff);
-				lock_destroy(curthread->ft[i]->lock);
-				kfree(curthread->ft[i]);
+				ftable_destroy(curthread->ft[i]);
 				curthread->ft[i] = NULL;
 				*err = EFAULT;
 				return -1;
@@ -84,8 +140,7 @@ open(userptr_t filename, int flags,int *err)
 			if(vfs_ret)
 			{
 				kfree(iobuff);
-				lock_destroy(curthread->ft[i]->lock);
-				kfree(curthread->ft[i]);
+				ftable_destroy(curthread->ft[i]);
 				curthread->ft[i] = NULL;
 				*err = vfs_ret;
 				return -1;
@@ -112,8 +167,7 @@ int close(int fd)
 	{
 		vfs_close(curthread->ft[fd]->vn);
 		lock_release(curthread->ft[fd]->lock);
-		lock_destroy(curthread->ft[fd]->lock);
-		kfree(curthread->ft[fd]);
+		ftable_destroy(curthread->ft[fd]);
 		curthread->ft[fd]=NULL;
 		return 0;
 	}
@@ -34,7 +34,8 @@
  * It makes the following address space calls:
  *    - first, as_define_region once for each segment of the program;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - then it maps each segment from the file with as_map_segment,
+ *      or loads it if it cannot be mapped;
  *    - finally, as_complete_load.
  *
  * This gives the VM code enough flexibility to deal with even grossly
@@ -42,8 +43,8 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Mapped segments are paged in from the executable as they are used,
+ * so exec costs the same however big the program is.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,11 +53,13 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
 #include <current.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <vnode.h>
 #include <elf.h>
 
@@ -157,6 +160,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
+	struct stat st;
+	bool mapped = false;
 
 	/*
 	 * Read the executable header from offset 0 in the file.
@@ -239,6 +244,15 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		/*
+		 * Mapped segments never go through uiomove, which would
+		 * catch segments in kernel space; check for them here.
+		 */
+		if (ph.p_vaddr + ph.p_memsz < ph.p_vaddr ||
+		    ph.p_vaddr + ph.p_memsz > USERSPACETOP) {
+			return ENOEXEC;
+		}
+
 		result = as_define_region(curthread->t_addrspace,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
@@ -254,8 +268,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+	/* Mapped segments are only read when used; check they are there */
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
 	/*
-	 * Now actually load each segment.
+	 * Now actually map or load each segment.
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -284,6 +304,27 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		if ((off_t)ph.p_offset + ph.p_filesz > st.st_size) {
+			kprintf("ELF: segment past end of file - file truncated?\n");
+			return ENOEXEC;
+		}
+
+		result = as_map_segment(curthread->t_addrspace, ph.p_vaddr,
+					ph.p_memsz, v, ph.p_offset,
+					ph.p_filesz);
+		if (result == 0) {
+			mapped = true;
+			continue;
+		}
+
+		/*
+		 * It shares a page with another segment, or is not at the
+		 * same place in a page in the file as in memory: copy it in.
+		 */
 		result = load_segment(v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
@@ -297,6 +338,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+	/*
+	 * Every process running this program maps the same cached pages
+	 * of its text; keep them cached for the next one too.
+	 */
+	if (mapped) {
+		pagecache_keep(v);
+	}
+
 	*entrypoint = eh.e_entry;
 
 	return 0;
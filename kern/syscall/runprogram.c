@@ -72,9 +72,9 @@ runprogram(char *progname, char *argv[], unsigned long argc)
 	KASSERT(errTemp!=1);
 
 	struct fTable *input, *output, *error;
-	input= kmalloc(sizeof(struct fTable));
-	output = kmalloc(sizeof(struct fTable));
-	error = kmalloc(sizeof(struct fTable));
+	input = ftable_create();
+	output = ftable_create();
+	error = ftable_create();
 	KASSERT(input!=NULL);
 	KASSERT(output!=NULL);
 	KASSERT(error!=NULL);
@@ -84,21 +84,18 @@ runprogram(char *progname, char *argv[], unsigned long argc)
 	input->ref_count =0;
 	input->status=O_RDONLY;
 	input->vn=i;
-	input->lock=lock_create("Standard Input");
 
 	output->name=kstrdup("Standard_Output");
 	output->offset=0;
 	output->ref_count =0;
 	output->status=O_WRONLY;
 	output->vn=o;
-	output->lock=lock_create("Standard Output");
 
 	error->name=kstrdup("Standard_Error");
 	error->offset=0;
 	error->ref_count =0;
 	error->status=O_WRONLY;
 	error->vn=e;
-	error->lock=lock_create("Standard Error");
 	KASSERT(input->lock!=NULL);
 	KASSERT(output->lock!=NULL);
 	KASSERT(error->lock!=NULL);
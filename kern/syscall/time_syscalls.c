@@ -28,6 +28,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <lib.h>
 #include <clock.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -56,3 +59,47 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * nanosleep: sleep for the time in REQ. It is rounded up to whole
+ * hardclocks, plus one since the current one is partly gone, so the
+ * sleep is never short. Long sleeps are taken an hour at a time to
+ * keep the tick counts in range. Nothing cuts a sleep short, so the
+ * time left, stored in REM if it is given, is always zero.
+ */
+#define NSEC_PER_TICK	(1000000000 / HZ)
+#define SLEEP_MAXSECS	3600
+
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec req, rem;
+	time_t secs;
+	int result;
+
+	result = copyin(user_req, &req, sizeof(req));
+	if (result) {
+		return result;
+	}
+	if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	for (secs = req.tv_sec; secs > 0; secs -= SLEEP_MAXSECS) {
+		clocksleep(secs < SLEEP_MAXSECS ? secs : SLEEP_MAXSECS);
+	}
+	if (req.tv_sec > 0 || req.tv_nsec > 0) {
+		clocksleep_ticks(DIVROUNDUP((unsigned)req.tv_nsec,
+					    NSEC_PER_TICK) + 1);
+	}
+
+	if (user_rem != NULL) {
+		rem.tv_sec = 0;
+		rem.tv_nsec = 0;
+		result = copyout(&rem, user_rem, sizeof(rem));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,211 @@
+/*
+ * vm_syscalls.c
+ *
+ *	Memory management system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/vmstat.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and hand back where it
+ * was. The heap runs from as->hbase, just past the program's regions,
+ * to as->htop, and may grow up to the lowest file mapping or the bottom
+ * of the stack; growing it only moves htop, since vm_fault gives heap
+ * pages memory the first time they are touched. The break need not be
+ * page-aligned. Pages that end up wholly above it when it shrinks are
+ * given back.
+ */
+int
+sys_sbrk(intptr_t amount, int32_t *retval)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	vaddr_t oldtop, newtop, va;
+	bool freed = false;
+	pte_t *pte;
+
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	oldtop = as->htop;
+	if (amount < 0) {
+		/* Negate unsigned, so INT32_MIN is not overflowed */
+		if (-(vaddr_t)amount > oldtop - as->hbase) {
+			return EINVAL;
+		}
+	}
+	else {
+		if ((vaddr_t)amount > as_heaplimit(as) - oldtop) {
+			return ENOMEM;
+		}
+	}
+	newtop = oldtop + amount;
+
+	for (va = ROUNDUP(newtop, PAGE_SIZE); va < oldtop; va += PAGE_SIZE) {
+		pte = pt_lookup(as->table, va, false);
+		if (pte != NULL && *pte != 0) {
+			pte_free(pte);
+			freed = true;
+		}
+	}
+	if (freed) {
+		/* Drop any translations left for the pages given back */
+		vm_tlbflush(as);
+	}
+
+	as->htop = newtop;
+	*retval = (int32_t)oldtop;
+	return 0;
+}
+
+/*
+ * mmap: map LEN bytes of the file open on FD, from OFFSET on, and hand
+ * back where. Only files whose VOP_MMAP agrees can be mapped. ADDR is
+ * only a hint, and is not taken. The pages come from the page cache
+ * the first time they are touched (see vm_fault); a MAP_SHARED mapping
+ * that may write needs the file open for writing too.
+ */
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int32_t *retval)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	struct fTable *f;
+	vaddr_t start;
+	int accmode, result;
+
+	(void)addr;
+
+	if (as == NULL) {
+		return EINVAL;
+	}
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	if ((flags & ~MAP_TYPE) != 0 ||
+	    ((flags & MAP_TYPE) != MAP_SHARED &&
+	     (flags & MAP_TYPE) != MAP_PRIVATE)) {
+		return EINVAL;
+	}
+	if (fd < 0 || fd >= OPEN_MAX || curthread->ft[fd] == NULL) {
+		return EBADF;
+	}
+	len = ROUNDUP(len, PAGE_SIZE);
+	if (len == 0) {
+		/* Wrapped around */
+		return ENOMEM;
+	}
+
+	f = curthread->ft[fd];
+	accmode = f->status & O_ACCMODE;
+	if (accmode == O_WRONLY) {
+		return EACCES;
+	}
+	if ((flags & MAP_TYPE) == MAP_SHARED && (prot & PROT_WRITE) &&
+	    accmode != O_RDWR) {
+		return EACCES;
+	}
+
+	result = VOP_MMAP(f->vn);
+	if (result == EUNIMP) {
+		return ENODEV;
+	}
+	if (result) {
+		return result;
+	}
+
+	result = as_map_file(as, len, f->vn, offset, prot,
+			     (flags & MAP_TYPE) == MAP_SHARED, &start);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)start;
+	return 0;
+}
+
+/*
+ * munmap: remove the file mappings in a range of pages. What shared
+ * ones changed is written back first.
+ */
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+	struct addrspace *as = curthread->t_addrspace;
+
+	if (as == NULL || addr % PAGE_SIZE != 0 || len == 0) {
+		return EINVAL;
+	}
+	len = ROUNDUP(len, PAGE_SIZE);
+	if (addr + len < addr || addr + len > USERSPACETOP) {
+		return EINVAL;
+	}
+	return as_unmap(as, addr, len);
+}
+
+/*
+ * msync: write back what shared file mappings in a range of pages
+ * changed. The writes are done before returning whatever FLAGS says,
+ * and there are no other cached copies to invalidate.
+ */
+int
+sys_msync(vaddr_t addr, size_t len, int flags)
+{
+	struct addrspace *as = curthread->t_addrspace;
+
+	if (as == NULL || addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) != 0 ||
+	    (flags & (MS_ASYNC | MS_SYNC)) == (MS_ASYNC | MS_SYNC)) {
+		return EINVAL;
+	}
+	len = ROUNDUP(len, PAGE_SIZE);
+	if (addr + len < addr || addr + len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	return as_sync(as, addr, len);
+}
+
+/*
+ * sync: write back dirty mapped file pages, then everything the file
+ * systems have cached.
+ */
+int
+sys_sync(void)
+{
+	int result;
+
+	result = pagecache_sync();
+	vfs_sync();
+	return result;
+}
+
+/*
+ * vmstat: copy out the VM event counters and how many pages are in
+ * each state (see <kern/vmstat.h>).
+ */
+int
+sys_vmstat(userptr_t buf)
+{
+	struct vmstats st;
+
+	vm_getstats(&st);
+	return copyout(&st, buf, sizeof(st));
+}
@@ -34,6 +34,8 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <clock.h>
+#include <vm.h>
 #include <test.h>
 
 /*
@@ -140,3 +142,114 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Page allocator benchmark.
+ *
+ * Times alloc_kpages and free_kpages for a range of block sizes, with
+ * physical memory fragmented by a set of single pages held for the
+ * whole run. For comparison it also times a linear walk over the
+ * coremap, which is what every allocation used to cost.
+ */
+
+#define PB_ROUNDS  200
+#define PB_BATCH   8
+#define PB_NHOLD   64
+#define PB_NWALKS  20
+
+static const unsigned long pb_sizes[] = { 1, 2, 3, 4, 8, 16, 0 };
+
+static
+uint32_t
+pb_elapsed_usecs(time_t secs1, uint32_t nsecs1)
+{
+	time_t secs2, secs;
+	uint32_t nsecs2, nsecs;
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	return secs * 1000000 + nsecs / 1000;
+}
+
+int
+pagebench(int nargs, char **args)
+{
+	static vaddr_t hold[2*PB_NHOLD];
+	vaddr_t batch[PB_BATCH];
+	time_t secs;
+	uint32_t nsecs, alloc_us, free_us, walk_us, nfree;
+	unsigned long npages;
+	unsigned i, j, k, ops;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator benchmark...\n");
+
+	/* Fragment memory: take single pages and give back every other one */
+	for (i=0; i<2*PB_NHOLD; i++) {
+		hold[i] = alloc_kpages(1);
+	}
+	for (i=0; i<2*PB_NHOLD; i+=2) {
+		if (hold[i] != 0) {
+			free_kpages(hold[i]);
+			hold[i] = 0;
+		}
+	}
+
+	for (k=0; pb_sizes[k] != 0; k++) {
+		npages = pb_sizes[k];
+		alloc_us = free_us = 0;
+		ops = 0;
+		for (i=0; i<PB_ROUNDS; i++) {
+			gettime(&secs, &nsecs);
+			for (j=0; j<PB_BATCH; j++) {
+				batch[j] = alloc_kpages(npages);
+			}
+			alloc_us += pb_elapsed_usecs(secs, nsecs);
+
+			gettime(&secs, &nsecs);
+			for (j=0; j<PB_BATCH; j++) {
+				if (batch[j] != 0) {
+					free_kpages(batch[j]);
+					ops++;
+				}
+			}
+			free_us += pb_elapsed_usecs(secs, nsecs);
+		}
+		if (ops == 0) {
+			kprintf("%3lu pages: allocation failed\n", npages);
+			continue;
+		}
+		kprintf("%3lu pages: alloc %6llu ns/op, free %6llu ns/op "
+			"(%u ops)\n", npages,
+			(unsigned long long)alloc_us * 1000 / ops,
+			(unsigned long long)free_us * 1000 / ops, ops);
+	}
+
+	/* What the old allocator paid on every call */
+	gettime(&secs, &nsecs);
+	nfree = 0;
+	for (i=0; i<PB_NWALKS; i++) {
+		for (j=0; j<page_num; j++) {
+			if (pages[j].page_state == FREE) {
+				nfree++;
+			}
+		}
+	}
+	walk_us = pb_elapsed_usecs(secs, nsecs);
+	/* Print what it counted, or the compiler drops the walk */
+	kprintf("linear coremap walk (%u pages, %u free): %llu ns/walk\n",
+		page_num, nfree / PB_NWALKS,
+		(unsigned long long)walk_us * 1000 / PB_NWALKS);
+
+	for (i=0; i<2*PB_NHOLD; i++) {
+		if (hold[i] != 0) {
+			free_kpages(hold[i]);
+		}
+	}
+
+	kprintf("page allocator benchmark done\n");
+
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * slabtest.c
+ *
+ *	Test for the kmem_cache object caches (see slab.h).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <slab.h>
+#include <test.h>
+
+#define SLABTEST_MAGIC	0x51ab51ab
+#define SLABTEST_OBJS	200	/* several slabs' worth */
+
+struct slabtest_obj {
+	uint32_t st_magic;	/* set by the constructor */
+	unsigned st_serial;	/* which construction this was */
+	char st_pad[120];
+};
+
+static unsigned slabtest_ctors, slabtest_dtors;
+static bool slabtest_failctor;
+
+static
+int
+slabtest_ctor(void *obj)
+{
+	struct slabtest_obj *o = obj;
+
+	if (slabtest_failctor) {
+		return ENOMEM;
+	}
+	o->st_magic = SLABTEST_MAGIC;
+	o->st_serial = ++slabtest_ctors;
+	return 0;
+}
+
+static
+void
+slabtest_dtor(void *obj)
+{
+	struct slabtest_obj *o = obj;
+
+	KASSERT(o->st_magic == SLABTEST_MAGIC);
+	o->st_magic = 0;
+	slabtest_dtors++;
+}
+
+int
+slabtest(int nargs, char **args)
+{
+	struct kmem_cache *kc;
+	struct slabtest_obj *objs[SLABTEST_OBJS], *o;
+	unsigned i, j, serial, ctors;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting object cache test...\n");
+
+	slabtest_ctors = slabtest_dtors = 0;
+	slabtest_failctor = false;
+	kc = kmem_cache_create("slabtest", sizeof(struct slabtest_obj),
+			       slabtest_ctor, slabtest_dtor);
+	KASSERT(kc != NULL);
+
+	/* Fresh objects are each constructed once, and are distinct */
+	for (i=0; i<SLABTEST_OBJS; i++) {
+		objs[i] = kmem_cache_alloc(kc);
+		KASSERT(objs[i] != NULL);
+		KASSERT(objs[i]->st_magic == SLABTEST_MAGIC);
+		for (j=0; j<i; j++) {
+			KASSERT(objs[i] != objs[j]);
+		}
+	}
+	KASSERT(slabtest_ctors == SLABTEST_OBJS);
+	KASSERT(slabtest_dtors == 0);
+
+	/* A freed object comes back as it was, without the constructor */
+	o = objs[SLABTEST_OBJS / 2];
+	serial = o->st_serial;
+	kmem_cache_free(kc, o);
+	objs[SLABTEST_OBJS / 2] = kmem_cache_alloc(kc);
+	KASSERT(objs[SLABTEST_OBJS / 2] == o);
+	KASSERT(o->st_magic == SLABTEST_MAGIC);
+	KASSERT(o->st_serial == serial);
+	KASSERT(slabtest_ctors == SLABTEST_OBJS);
+
+	/*
+	 * Freeing everything releases all but one slab, destructing
+	 * what was on them; what is left stays constructed.
+	 */
+	for (i=0; i<SLABTEST_OBJS; i++) {
+		kmem_cache_free(kc, objs[i]);
+	}
+	KASSERT(slabtest_dtors > 0);
+	KASSERT(slabtest_dtors < SLABTEST_OBJS);
+
+	/* Allocating from the slab kept back constructs nothing */
+	ctors = slabtest_ctors;
+	o = kmem_cache_alloc(kc);
+	KASSERT(o != NULL);
+	KASSERT(o->st_magic == SLABTEST_MAGIC);
+	KASSERT(slabtest_ctors == ctors);
+	kmem_cache_free(kc, o);
+
+	/*
+	 * Once the kept slab's objects are used up, new ones need the
+	 * constructor; if it fails, so does the allocation, and the
+	 * object is not lost.
+	 */
+	for (i=0; i<SLABTEST_OBJS; i++) {
+		objs[i] = kmem_cache_alloc(kc);
+		KASSERT(objs[i] != NULL);
+		if (slabtest_ctors > ctors) {
+			break;
+		}
+	}
+	KASSERT(i < SLABTEST_OBJS);
+	slabtest_failctor = true;
+	KASSERT(kmem_cache_alloc(kc) == NULL);
+	slabtest_failctor = false;
+	o = kmem_cache_alloc(kc);
+	KASSERT(o != NULL);
+	KASSERT(o->st_magic == SLABTEST_MAGIC);
+	kmem_cache_free(kc, o);
+	for (j=0; j<=i; j++) {
+		kmem_cache_free(kc, objs[j]);
+	}
+
+	/* Destroying the cache destructs everything ever constructed */
+	kmem_cache_destroy(kc);
+	KASSERT(slabtest_dtors == slabtest_ctors);
+
+	kprintf("Object cache test complete\n");
+	return 0;
+}
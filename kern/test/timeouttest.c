@@ -0,0 +1,336 @@
+/*
+ * timeouttest.c
+ *
+ *	Tests for timeouts and the timed sleeps built on them,
+ *	wchan_sleep_timeout and cv_wait_timeout.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <synch.h>
+#include <timeout.h>
+#include <test.h>
+
+#define NSEC_PER_TICK	(1000000000 / HZ)
+#define SHORT_TICKS	(HZ / 10 + 1)	/* for sleeps that should time out */
+#define LONG_TICKS	(HZ / 2)	/* for sleeps that should not */
+#define NWAKERS		8		/* threads racing to another cpu */
+
+/* What a test sleeps on */
+#define TT_WCHAN	0
+#define TT_CV		1
+
+static const char *const tt_names[] = { "wchan_sleep_timeout",
+					"cv_wait_timeout" };
+
+static struct wchan *tt_wchan;
+static struct lock *tt_lock;
+static struct cv *tt_cv;
+static struct semaphore *tt_donesem;
+static struct spinlock tt_spinlock = SPINLOCK_INITIALIZER;
+
+static volatile unsigned tt_fired;	/* calls of tt_fire */
+static volatile bool tt_flag;		/* what the cv waits for */
+static struct cpu *volatile tt_sleepcpu; /* where the sleeper went to sleep */
+static volatile bool tt_crosscpu;	/* waker must be on another cpu */
+static volatile bool tt_giveup;		/* wakers should stop trying */
+static bool tt_claimed;			/* a waker has taken the job */
+static int tt_failures;
+
+static
+void
+inititems(void)
+{
+	if (tt_wchan == NULL) {
+		tt_wchan = wchan_create("timeouttest");
+		if (tt_wchan == NULL) {
+			panic("timeouttest: wchan_create failed\n");
+		}
+	}
+	if (tt_lock == NULL) {
+		tt_lock = lock_create("timeouttest");
+		if (tt_lock == NULL) {
+			panic("timeouttest: lock_create failed\n");
+		}
+	}
+	if (tt_cv == NULL) {
+		tt_cv = cv_create("timeouttest");
+		if (tt_cv == NULL) {
+			panic("timeouttest: cv_create failed\n");
+		}
+	}
+	if (tt_donesem == NULL) {
+		tt_donesem = sem_create("timeouttest", 0);
+		if (tt_donesem == NULL) {
+			panic("timeouttest: sem_create failed\n");
+		}
+	}
+}
+
+static
+uint64_t
+tt_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/* Only the thread running the test calls this. */
+static
+void
+tt_check(bool ok, unsigned long how, const char *msg)
+{
+	if (!ok) {
+		kprintf("%s: %s\n", tt_names[how], msg);
+		tt_failures++;
+	}
+}
+
+static
+void
+tt_fire(void *junk)
+{
+	(void)junk;
+	tt_fired++;
+}
+
+/*
+ * Sleep for up to TICKS, in the way HOW says, and return what the
+ * sleep did.
+ */
+static
+int
+tt_sleep(unsigned long how, unsigned ticks)
+{
+	int result = 0;
+
+	if (how == TT_WCHAN) {
+		wchan_lock(tt_wchan);
+		tt_sleepcpu = curcpu->c_self;
+		return wchan_sleep_timeout(tt_wchan, ticks);
+	}
+
+	lock_acquire(tt_lock);
+	tt_sleepcpu = curcpu->c_self;
+	while (!tt_flag && result == 0) {
+		result = cv_wait_timeout(tt_cv, tt_lock, ticks);
+	}
+	tt_check(lock_do_i_hold(tt_lock), how, "returned without the lock");
+	lock_release(tt_lock);
+	return result;
+}
+
+/*
+ * Is the sleeper asleep? With the cv the waker needn't know: it
+ * cannot get the lock until the sleeper is.
+ */
+static
+bool
+tt_asleep(unsigned long how)
+{
+	if (tt_sleepcpu == NULL) {
+		return false;
+	}
+	return how == TT_CV || !wchan_isempty(tt_wchan);
+}
+
+static
+void
+tt_wake(unsigned long how)
+{
+	if (how == TT_WCHAN) {
+		wchan_wakeall(tt_wchan);
+		return;
+	}
+	lock_acquire(tt_lock);
+	tt_flag = true;
+	cv_signal(tt_cv, tt_lock);
+	lock_release(tt_lock);
+}
+
+/*
+ * Wait for the sleeper to be asleep, on another cpu than ours if
+ * tt_crosscpu is set, and wake it, unless another waker gets there
+ * first. Yielding puts us back on the run queue, where an idle cpu
+ * can steal us.
+ */
+static
+void
+tt_wakerthread(void *junk, unsigned long how)
+{
+	bool mine = false;
+
+	(void)junk;
+
+	while (!tt_giveup) {
+		if (tt_asleep(how) &&
+		    (!tt_crosscpu || curcpu->c_self != tt_sleepcpu)) {
+			spinlock_acquire(&tt_spinlock);
+			mine = !tt_claimed;
+			tt_claimed = true;
+			spinlock_release(&tt_spinlock);
+			break;
+		}
+		thread_yield();
+	}
+	if (mine) {
+		tt_wake(how);
+	}
+	V(tt_donesem);
+}
+
+static
+void
+tt_timeouts(void)
+{
+	struct timeout to;
+
+	kprintf("Timeouts...\n");
+	timeout_init(&to, tt_fire, NULL);
+
+	/* Cancelled before it goes off: it never does */
+	tt_fired = 0;
+	timeout_set(&to, SHORT_TICKS);
+	if (!timeout_cancel(&to)) {
+		kprintf("timeout_cancel missed a pending timeout\n");
+		tt_failures++;
+	}
+	clocksleep_ticks(2 * SHORT_TICKS);
+	if (tt_fired != 0) {
+		kprintf("cancelled timeout went off\n");
+		tt_failures++;
+	}
+
+	/* Left alone: it goes off once, and is not pending afterwards */
+	timeout_set(&to, SHORT_TICKS);
+	clocksleep_ticks(2 * SHORT_TICKS);
+	if (tt_fired != 1) {
+		kprintf("timeout went off %u times\n", tt_fired);
+		tt_failures++;
+	}
+	if (timeout_cancel(&to)) {
+		kprintf("timeout still pending after going off\n");
+		tt_failures++;
+	}
+}
+
+/* Nobody wakes us: the sleep times out, and not early */
+static
+void
+tt_timedout(unsigned long how)
+{
+	uint64_t start, elapsed;
+	int result;
+
+	kprintf("%s, timing out...\n", tt_names[how]);
+
+	tt_flag = false;
+	start = tt_now();
+	result = tt_sleep(how, SHORT_TICKS);
+	elapsed = tt_now() - start;
+
+	tt_check(result == ETIMEDOUT, how, "did not time out");
+	/* The tick it was set in was partly gone already */
+	tt_check(elapsed >= (uint64_t)(SHORT_TICKS - 1) * NSEC_PER_TICK,
+		 how, "timed out early");
+	tt_check(wchan_isempty(how == TT_WCHAN ? tt_wchan : tt_cv->cv_waitchan),
+		 how, "left the thread on the wchan");
+}
+
+/*
+ * Somebody wakes us long before the timeout: the sleep returns 0, and
+ * the timeout is cancelled. If it were not, it would go off during the
+ * next, longer, sleep on the same channel and cut it short.
+ */
+static
+void
+tt_woken(unsigned long how, bool crosscpu)
+{
+	uint64_t start, elapsed;
+	unsigned i, nwakers;
+	int result;
+
+	kprintf("%s, woken %s...\n", tt_names[how],
+		crosscpu ? "from another cpu" : "early");
+
+	nwakers = crosscpu ? NWAKERS : 1;
+	tt_flag = false;
+	tt_sleepcpu = NULL;
+	tt_crosscpu = crosscpu;
+	tt_giveup = false;
+	tt_claimed = false;
+	for (i=0; i<nwakers; i++) {
+		result = thread_fork("timeouttest", tt_wakerthread, NULL, how,
+				     NULL);
+		if (result) {
+			panic("timeouttest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	start = tt_now();
+	result = tt_sleep(how, LONG_TICKS);
+	elapsed = tt_now() - start;
+
+	tt_giveup = true;
+	for (i=0; i<nwakers; i++) {
+		P(tt_donesem);
+	}
+
+	if (crosscpu && !tt_claimed) {
+		/* Only one cpu, or the others never took a waker */
+		kprintf("%s: no waker got to another cpu; not tested\n",
+			tt_names[how]);
+		return;
+	}
+	tt_check(result == 0, how, "woken thread timed out");
+	tt_check(elapsed < (uint64_t)LONG_TICKS * NSEC_PER_TICK, how,
+		 "woken thread slept the whole time");
+
+	tt_flag = false;
+	start = tt_now();
+	result = tt_sleep(how, 2 * LONG_TICKS);
+	elapsed = tt_now() - start;
+
+	tt_check(result == ETIMEDOUT, how, "second sleep did not time out");
+	tt_check(elapsed >= (uint64_t)(2 * LONG_TICKS - 1) * NSEC_PER_TICK,
+		 how, "timeout of the earlier sleep was not cancelled");
+}
+
+int
+timeouttest(int nargs, char **args)
+{
+	unsigned long how;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting timeout test...\n");
+
+	tt_failures = 0;
+	tt_timeouts();
+	for (how = TT_WCHAN; how <= TT_CV; how++) {
+		tt_timedout(how);
+		tt_woken(how, false);
+		tt_woken(how, true);
+	}
+
+	if (tt_failures > 0) {
+		kprintf("Timeout test failed\n");
+	}
+	else {
+		kprintf("Timeout test done.\n");
+	}
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
+#include <timeout.h>
 #include <thread.h>
 #include <current.h>
 
@@ -54,9 +55,10 @@
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Threads in clocksleep() wait here. Nothing wakes the channel; each
+ * sleeper's own timeout takes it off.
  */
-static struct wchan *lbolt;
+static struct wchan *sleepchan;
 
 /*
  * Setup.
@@ -64,21 +66,20 @@ static struct wchan *lbolt;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	sleepchan = wchan_create("clocksleep");
+	if (sleepchan == NULL) {
+		panic("Couldn't create clocksleep channel\n");
 	}
 }
 
 /*
  * This is called once per second, on one processor, by the timer
- * code.
+ * code. Timed waits go on the timer wheels now (see hardclock), so
+ * there is nothing to do here.
  */
 void
 timerclock(void)
 {
-	/* Just broadcast on lbolt */
-	wchan_wakeall(lbolt);
 }
 
 /*
@@ -88,18 +89,25 @@ timerclock(void)
 void
 hardclock(void)
 {
+	bool preempt;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
 	curcpu->c_hardclocks++;
+	timewheel_tick(&curcpu->c_timers);
+	preempt = thread_tick();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	if (preempt) {
+		/* Time slice used up; see thread_tick */
+		thread_preempt();
+	}
 }
 
 /*
@@ -108,9 +116,20 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	while (num_secs > 0) {
-		wchan_lock(lbolt);
-		wchan_sleep(lbolt);
-		num_secs--;
+	if (num_secs > 0) {
+		clocksleep_ticks((unsigned)num_secs * HZ);
+	}
+}
+
+/*
+ * Suspend execution for n hardclocks.
+ */
+void
+clocksleep_ticks(unsigned ticks)
+{
+	if (ticks == 0) {
+		return;
 	}
+	wchan_lock(sleepchan);
+	wchan_sleep_timeout(sleepchan, ticks);
 }
@@ -0,0 +1,205 @@
+/*
+ * runqueue.c
+ *
+ *	Per-CPU queues of runnable threads (see runqueue.h).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <thread.h>
+#include <runqueue.h>
+
+#if OPT_MLFQ
+
+void
+runqueue_init(struct runqueue *rq)
+{
+	unsigned i;
+
+	for (i=0; i<RUNQ_LEVELS; i++) {
+		threadlist_init(&rq->rq_levels[i]);
+	}
+	rq->rq_nonempty = 0;
+	rq->rq_count = 0;
+}
+
+void
+runqueue_cleanup(struct runqueue *rq)
+{
+	unsigned i;
+
+	KASSERT(rq->rq_count == 0);
+	for (i=0; i<RUNQ_LEVELS; i++) {
+		threadlist_cleanup(&rq->rq_levels[i]);
+	}
+}
+
+bool
+runqueue_isempty(struct runqueue *rq)
+{
+	return rq->rq_count == 0;
+}
+
+void
+runqueue_add(struct runqueue *rq, struct thread *t)
+{
+	int level = t->priority;
+
+	KASSERT(level >= 0 && level < RUNQ_LEVELS);
+	threadlist_addtail(&rq->rq_levels[level], t);
+	rq->rq_nonempty |= (uint32_t)1 << level;
+	rq->rq_count++;
+}
+
+/* Take a thread off LEVEL, from the front or the back */
+static
+struct thread *
+runqueue_take(struct runqueue *rq, int level, bool head)
+{
+	struct threadlist *tl = &rq->rq_levels[level];
+	struct thread *t;
+
+	t = head ? threadlist_remhead(tl) : threadlist_remtail(tl);
+	KASSERT(t != NULL);
+	if (threadlist_isempty(tl)) {
+		rq->rq_nonempty &= ~((uint32_t)1 << level);
+	}
+	rq->rq_count--;
+	return t;
+}
+
+struct thread *
+runqueue_remhead(struct runqueue *rq)
+{
+	if (rq->rq_nonempty == 0) {
+		return NULL;
+	}
+	/* The lowest set bit is the highest level with threads */
+	return runqueue_take(rq, __builtin_ctz(rq->rq_nonempty), true);
+}
+
+struct thread *
+runqueue_remtail(struct runqueue *rq)
+{
+	if (rq->rq_nonempty == 0) {
+		return NULL;
+	}
+	return runqueue_take(rq, 31 - __builtin_clz(rq->rq_nonempty), false);
+}
+
+bool
+runqueue_preempts(struct runqueue *rq, struct thread *t)
+{
+	/* Anything on t's level or above goes first */
+	return (rq->rq_nonempty & (((uint32_t)2 << t->priority) - 1)) != 0;
+}
+
+bool
+runqueue_outranks(struct runqueue *rq, struct thread *t)
+{
+	return (rq->rq_nonempty & (((uint32_t)1 << t->priority) - 1)) != 0;
+}
+
+/*
+ * Threads keep their places within a level, and the levels keep their
+ * order, so the threads that were waiting longest at the top still go
+ * first. Resetting their usage gives each a fresh allotment at the top.
+ */
+void
+runqueue_boost(struct runqueue *rq)
+{
+	struct threadlist *top = &rq->rq_levels[0];
+	struct thread *t;
+	unsigned i;
+
+	THREADLIST_FORALL(t, *top) {
+		t->t_usage = 0;
+	}
+	for (i=1; i<RUNQ_LEVELS; i++) {
+		while ((t = threadlist_remhead(&rq->rq_levels[i])) != NULL) {
+			t->priority = 0;
+			t->t_usage = 0;
+			threadlist_addtail(top, t);
+		}
+	}
+	if (rq->rq_count > 0) {
+		rq->rq_nonempty = 1;
+	}
+}
+
+#else /* !OPT_MLFQ */
+
+void
+runqueue_init(struct runqueue *rq)
+{
+	threadlist_init(&rq->rq_list);
+	rq->rq_count = 0;
+}
+
+void
+runqueue_cleanup(struct runqueue *rq)
+{
+	KASSERT(rq->rq_count == 0);
+	threadlist_cleanup(&rq->rq_list);
+}
+
+bool
+runqueue_isempty(struct runqueue *rq)
+{
+	return rq->rq_count == 0;
+}
+
+void
+runqueue_add(struct runqueue *rq, struct thread *t)
+{
+	threadlist_addtail(&rq->rq_list, t);
+	rq->rq_count++;
+}
+
+struct thread *
+runqueue_remhead(struct runqueue *rq)
+{
+	struct thread *t;
+
+	t = threadlist_remhead(&rq->rq_list);
+	if (t != NULL) {
+		rq->rq_count--;
+	}
+	return t;
+}
+
+struct thread *
+runqueue_remtail(struct runqueue *rq)
+{
+	struct thread *t;
+
+	t = threadlist_remtail(&rq->rq_list);
+	if (t != NULL) {
+		rq->rq_count--;
+	}
+	return t;
+}
+
+bool
+runqueue_preempts(struct runqueue *rq, struct thread *t)
+{
+	(void)t;
+	return rq->rq_count > 0;
+}
+
+bool
+runqueue_outranks(struct runqueue *rq, struct thread *t)
+{
+	(void)rq;
+	(void)t;
+	return false;
+}
+
+void
+runqueue_boost(struct runqueue *rq)
+{
+	/* One list: there is nowhere to move anything */
+	(void)rq;
+}
+
+#endif /* OPT_MLFQ */
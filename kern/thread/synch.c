@@ -320,6 +320,24 @@ cv_wait(struct cv *cv, struct lock *lock)
 		lock_acquire(lock);
 }
 
+int
+cv_wait_timeout(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+	int result;
+
+	KASSERT(cv != NULL);
+	KASSERT(lock != NULL);
+
+	wchan_lock(cv->cv_waitchan);
+	if(lock_do_i_hold(lock))
+		lock_release(lock);
+	result = wchan_sleep_timeout(cv->cv_waitchan, ticks);
+
+	if(!lock_do_i_hold(lock))
+		lock_acquire(lock);
+	return result;
+}
+
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
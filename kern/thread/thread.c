@@ -41,6 +41,7 @@
 #include <wchan.h>
 #include <thread.h>
 #include <threadlist.h>
+#include <runqueue.h>
 #include <threadprivate.h>
 #include <current.h>
 #include <synch.h>
@@ -50,9 +51,13 @@
 #include <limits.h>
 #include <process.h>
 #include <syscall.h>
+#include <slab.h>
+#include <clock.h>
+#include <timeout.h>
 
 #include "opt-synchprobs.h"
 #include "opt-defaultscheduler.h"
+#include "opt-mlfq.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -73,6 +78,82 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Where thread structures come from. */
+static struct kmem_cache *thread_cache;
+
+/*
+ * Exited threads are not torn down in thread_switch; they wait on the
+ * cpu's zombie list until exorcise() gets to them, which is done when
+ * a thread is forked, when the cpu goes idle, or once there are more
+ * than THREAD_ZOMBIES_MAX. Up to THREAD_CACHE_MAX of them per cpu are
+ * then kept, with their stacks and stack guard bands, for thread_fork
+ * to reuse.
+ */
+#define THREAD_CACHE_MAX	8
+#define THREAD_ZOMBIES_MAX	16
+
+/*
+ * Time slices.
+ *
+ * A thread that is switched to gets a slice of its scheduling class's
+ * quantum, in hardclocks, and is preempted when that runs out (or,
+ * with the MLFQ scheduler, when it moves down a level or a thread on
+ * a higher level is waiting) if anything else is ready. With the MLFQ
+ * scheduler each run queue level is a class, and lower levels get
+ * longer slices; otherwise there is just one class.
+ */
+#if OPT_MLFQ
+#define THREAD_CLASSES		RUNQ_LEVELS
+#define THREAD_CLASS(t)		((unsigned)(t)->priority)
+#else
+#define THREAD_CLASSES		1
+#define THREAD_CLASS(t)		0
+#endif
+#define QUANTUM_DEFAULT		4	/* one class */
+#define QUANTUM_LONGEST		32	/* default for the lowest levels */
+#define QUANTUM_MAX		HZ	/* a second */
+
+static unsigned thread_quantum[THREAD_CLASSES];
+
+static
+void
+thread_quantum_init(void)
+{
+	unsigned i;
+
+	for (i=0; i<THREAD_CLASSES; i++) {
+#if OPT_MLFQ
+		thread_quantum[i] = (1U << i) < QUANTUM_LONGEST ?
+			(1U << i) : QUANTUM_LONGEST;
+#else
+		thread_quantum[i] = QUANTUM_DEFAULT;
+#endif
+	}
+}
+
+unsigned
+thread_numclasses(void)
+{
+	return THREAD_CLASSES;
+}
+
+unsigned
+thread_getquantum(unsigned class)
+{
+	KASSERT(class < THREAD_CLASSES);
+	return thread_quantum[class];
+}
+
+int
+thread_setquantum(unsigned class, unsigned ticks)
+{
+	if (class >= THREAD_CLASSES || ticks == 0 || ticks > QUANTUM_MAX) {
+		return EINVAL;
+	}
+	thread_quantum[class] = ticks;
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -112,21 +193,62 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor and destructor for thread_cache. A thread's run queue
+ * link and machine-dependent part are in the same state whenever it
+ * is not in use (off every list, no fault handler set), so they are
+ * set up once per object rather than by every thread_create.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread_machdep_init(&thread->t_machdep);
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * If CACHED is true, a thread from the current cpu's cache may be
+ * used; it comes with its stack already allocated. (Not for the first
+ * threads, which are made before curcpu can be used.) Otherwise the
+ * new thread has no stack.
  */
 static
 struct thread *
-thread_create(const char *name)
+thread_create(const char *name, bool cached)
 {
-	struct thread *thread;
+	struct thread *thread = NULL;
+	int spl;
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	if (cached) {
+		spl = splhigh();
+		thread = threadlist_remhead(&curcpu->c_freethreads);
+		splx(spl);
+	}
 	if (thread == NULL) {
-		return NULL;
+		thread = kmem_cache_alloc(thread_cache);
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = NULL;
 	}
 
 	/**
@@ -138,16 +260,17 @@ thread_create(const char *name)
 		panic("Process creation failed during thread_create");
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		if (thread->t_stack != NULL) {
+			kfree(thread->t_stack);
+		}
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
+	thread->t_wchan = NULL;
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* Thread subsystem fields (the rest are set up by thread_ctor) */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 
@@ -191,15 +314,18 @@ thread_create(const char *name)
 		int i;
 		for (i=0;i<OPEN_MAX;i++)
 		{
-			thread->ft[i] = kmalloc(sizeof(struct file_table *));
-			if (thread->ft[i] == NULL)
-					{
-						kfree(thread);
-						return NULL;
-					}
-			thread->ft[i]=0;
+			thread->ft[i]=NULL;
 		}
+#if OPT_MLFQ
+		/* New threads start at the top */
+		thread->priority = 0;
+#else
 		thread->priority = 5;
+#endif
+		thread->t_usage = 0;
+		thread->t_slice = 0;
+		thread->t_nvcsw = 0;
+		thread->t_nivcsw = 0;
 
 	return thread;
 }
@@ -216,6 +342,7 @@ struct cpu *
 cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
+	unsigned i;
 	int result;
 	char namebuf[16];
 
@@ -229,14 +356,25 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_freethreads);
 	c->c_hardclocks = 0;
+	c->c_nvcsw = 0;
+	c->c_nivcsw = 0;
+	c->c_asid = 0;
+	c->c_asid_generation = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	runqueue_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
 
+	timewheel_init(&c->c_timers);
+
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	for (i=0; i<TLBSHOOTDOWN_MAX; i++) {
+		c->c_shootdown_sems[i] = NULL;
+		c->c_shootdown_owed[i] = 0;
+	}
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -245,7 +383,7 @@ cpu_create(unsigned hardware_number)
 	}
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
-	c->c_curthread = thread_create(namebuf);
+	c->c_curthread = thread_create(namebuf, false);
 	if (c->c_curthread == NULL) {
 		panic("cpu_create: thread_create failed\n");
 	}
@@ -299,12 +437,10 @@ thread_destroy(struct thread *thread)
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
 
-	/* Thread subsystem fields */
+	/* Thread subsystem fields; thread_dtor does the rest */
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
@@ -312,25 +448,64 @@ thread_destroy(struct thread *thread)
 	DEBUG(DB_THREADS, "%s Thread destroyed.",thread->t_name); 
 	kfree(thread->t_name);
 	//if(thread->ft!=NULL)kfree(thread->ft);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
+}
+
+/*
+ * Put an exited thread in the current cpu's cache, or destroy it if
+ * the cache is full. Its name is freed here, as thread_create makes a
+ * new one; the stack, whose guard band must still be intact, is kept.
+ */
+static
+void
+thread_recycle(struct thread *thread)
+{
+	KASSERT(thread != curthread);
+	KASSERT(thread->t_state == S_ZOMBIE);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_freethreads.tl_count >= THREAD_CACHE_MAX) {
+		thread_destroy(thread);
+		return;
+	}
+
+	/* Cleaned up in thread_exit */
+	KASSERT(thread->t_cwd == NULL);
+	KASSERT(thread->t_addrspace == NULL);
+
+	thread_checkstack(thread);
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "CACHED";
+
+	threadlist_addhead(&curcpu->c_freethreads, thread);
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
  * need to have thread_destroy called on them.)
  *
- * The list of zombies is per-cpu.
+ * The list of zombies is per-cpu. Interrupts must be off, so as not
+ * to move to another cpu partway. When the cpu idles after a thread
+ * exits, the idle loop runs on the exited thread's stack; that thread
+ * is left for next time.
  */
 static
 void
 exorcise(void)
 {
-	struct thread *z;
+	struct thread *z, *self = NULL;
 
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
-		KASSERT(z != curthread);
+		if (z == curthread) {
+			self = z;
+			continue;
+		}
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_recycle(z);
+	}
+	if (self != NULL) {
+		threadlist_addtail(&curcpu->c_zombies, self);
 	}
 }
 
@@ -353,12 +528,10 @@ thread_panic(void)
 	 * Drop runnable threads on the floor.
 	 *
 	 * Don't try to get the run queue lock; we might not be able
-	 * to.  Instead, blat the list structure by hand, and take the
+	 * to.  Instead, reinitialize the queue by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	runqueue_init(&curcpu->c_runqueue);
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -403,6 +576,13 @@ thread_bootstrap(void)
 	struct thread *bootthread;
 
 	cpuarray_init(&allcpus);
+	thread_quantum_init();
+
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
 
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
@@ -500,7 +680,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(&targetcpu->c_runqueue, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -533,18 +713,27 @@ thread_fork(const char *name,
 {
 	struct thread *newthread;
 	int i=0;
-	newthread = thread_create(name);
+	int spl;
+
+	/* Refill the thread cache from this cpu's zombies */
+	spl = splhigh();
+	exorcise();
+	splx(spl);
+
+	newthread = thread_create(name, true);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless it came from the cache */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -602,6 +791,77 @@ thread_fork(const char *name,
 	return 0;
 }
 
+/*
+ * Work stealing.
+ *
+ * Called by a cpu that has run out of threads, before it idles. The
+ * busiest other cpu is picked by its run queue count, read without
+ * the lock, and half of its queue is moved here. Threads are taken
+ * from the tail: those that would otherwise wait longest there (and,
+ * with the MLFQ scheduler, the least interactive ones). Returns true
+ * if any threads were taken.
+ */
+static
+bool
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct threadlist stolen;
+	struct thread *t;
+	unsigned i, numcpus, load, maxload, n;
+
+	victim = NULL;
+	maxload = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		load = c->c_runqueue.rq_count;
+		if (load > maxload) {
+			maxload = load;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return false;
+	}
+
+	threadlist_init(&stolen);
+	spinlock_acquire(&victim->c_runqueue_lock);
+	n = DIVROUNDUP(victim->c_runqueue.rq_count, 2);
+	for (; n > 0; n--) {
+		t = runqueue_remtail(&victim->c_runqueue);
+		if (t == NULL) {
+			break;
+		}
+		if (t == victim->c_curthread) {
+			/* See thread_consider_migration */
+			runqueue_add(&victim->c_runqueue, t);
+			break;
+		}
+		t->t_cpu = curcpu->c_self;
+		threadlist_addhead(&stolen, t);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	if (threadlist_isempty(&stolen)) {
+		threadlist_cleanup(&stolen);
+		return false;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&stolen)) != NULL) {
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+		runqueue_add(&curcpu->c_runqueue, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	threadlist_cleanup(&stolen);
+	return true;
+}
+
 /*
  * High level, machine-independent context switch code.
  *
@@ -609,11 +869,13 @@ thread_fork(const char *name,
  * to NEWSTATE; another thread to run is selected and switched to.
  *
  * If NEWSTATE is S_SLEEP, the thread is queued on the wait channel
- * WC. Otherwise WC should be NULL.
+ * WC. Otherwise WC should be NULL. PREEMPT is true if the thread is
+ * being made to give up the cpu rather than doing so itself; it only
+ * decides which switch count is bumped.
  */
 static
 void
-thread_switch(threadstate_t newstate, struct wchan *wc)
+thread_switch(threadstate_t newstate, struct wchan *wc, bool preempt)
 {
 	struct thread *cur, *next;
 	int spl;
@@ -637,17 +899,26 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
+#if !OPT_MLFQ
 	if ( cur->priority > 0 && cur->priority< 10)
 	{
 		if (newstate == S_SLEEP)cur->priority--;     //increment priority if thread was sleeping
 		if (newstate == S_READY)cur->priority++;     //decrement priority if thread was ready
 	}
+#endif
 
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing should run before us, just
+	 * return. With the MLFQ scheduler that includes everything on
+	 * lower levels.
+	 */
+	if (newstate == S_READY &&
+	    !runqueue_preempts(&curcpu->c_runqueue, cur)) {
+		/* Carry on, with a fresh slice */
+		cur->t_slice = thread_quantum[THREAD_CLASS(cur)];
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -678,6 +949,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		 * without racing. Exercise: what's the other?)
 		 */
 		threadlist_addtail(&wc->wc_threads, cur);
+		cur->t_wchan = wc;
 		wchan_unlock(wc);
 		break;
 	    case S_ZOMBIE:
@@ -687,6 +959,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	}
 	cur->t_state = newstate;
 
+	if (preempt) {
+		cur->t_nivcsw++;
+		curcpu->c_nivcsw++;
+	}
+	else {
+		cur->t_nvcsw++;
+		curcpu->c_nvcsw++;
+	}
+
 
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
@@ -708,10 +989,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/*
+			 * Reap exited threads, then take work from a
+			 * busier cpu; failing that, zero a page for
+			 * later, or else sleep.
+			 */
+			exorcise();
+			if (!thread_steal() && !vm_zero_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -726,6 +1015,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 */
 	curcpu->c_curthread = next;
 	curthread = next;
+	next->t_slice = thread_quantum[THREAD_CLASS(next)];
 
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
@@ -789,8 +1079,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		as_activate(cur->t_addrspace);
 	}
 
-	/* Clean up dead threads. */
-	exorcise();
+	/* Clean up dead threads, if they are piling up. */
+	if (curcpu->c_zombies.tl_count > THREAD_ZOMBIES_MAX) {
+		exorcise();
+	}
 
 	/* Turn interrupts back on. */
 	splx(spl);
@@ -824,8 +1116,10 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 		as_activate(cur->t_addrspace);
 	}
 
-	/* Clean up dead threads. */
-	exorcise();
+	/* Clean up dead threads, if they are piling up. */
+	if (curcpu->c_zombies.tl_count > THREAD_ZOMBIES_MAX) {
+		exorcise();
+	}
 
 	/* Enable interrupts. */
 	spl0();
@@ -914,7 +1208,9 @@ thread_exit(void)
 		V(curthread->t_process->p_exitsem);
 	}
 
-	thread_switch(S_ZOMBIE, NULL);
+	DEBUG(DB_THREADS, "Thread %s: %u voluntary, %u involuntary switches",
+	      curthread->t_name, curthread->t_nvcsw, curthread->t_nivcsw);
+	thread_switch(S_ZOMBIE, NULL, false);
 	panic("The zombie walks!\n");
 }
 
@@ -924,7 +1220,16 @@ thread_exit(void)
 void
 thread_yield(void)
 {
-	thread_switch(S_READY, NULL);
+	thread_switch(S_READY, NULL, false);
+}
+
+/*
+ * Take the cpu away from the current thread, which stays runnable.
+ */
+void
+thread_preempt(void)
+{
+	thread_switch(S_READY, NULL, true);
 }
 
 ////////////////////////////////////////////////////////////
@@ -936,6 +1241,39 @@ thread_yield(void)
  * the current CPU's run queue by job priority.
  */
 
+#if OPT_MLFQ
+
+/*
+ * Multi-level feedback queue. Threads start on level 0 (see
+ * thread_create) and thread_switch always picks from the highest
+ * level that has threads, taking turns within it a time slice at a
+ * time (see below). A thread that
+ * uses up its allotment at a level, counted in clock ticks across
+ * however many turns it takes, moves down one; the allotment doubles
+ * with each level. So that threads far down are not starved, and
+ * ones that changed behavior are not stuck there, everything on the
+ * CPU is moved back to the top once a second.
+ */
+#define MLFQ_ALLOTMENT(level)	(2U << (level))
+#define MLFQ_BOOST_HARDCLOCKS	HZ
+
+void
+schedule(void)
+{
+	if ((curcpu->c_hardclocks % MLFQ_BOOST_HARDCLOCKS) != 0) {
+		return;
+	}
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_boost(&curcpu->c_runqueue);
+	if (!curcpu->c_isidle) {
+		curthread->priority = 0;
+		curthread->t_usage = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+#else /* !OPT_MLFQ */
+
 #if OPT_DEFAULTSCHEDULER
 void
 schedule(void)
@@ -949,19 +1287,19 @@ schedule(void)
   // 28 Feb 2012 : GWA : Implement your scheduler that prioritizes
   // "interactive" threads here.
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	if (curcpu->c_runqueue.tl_count>1)
+	if (curcpu->c_runqueue.rq_list.tl_count>1)
 	{
-		struct threadlistnode *tnode = &curcpu->c_runqueue.tl_head;
+		struct threadlistnode *tnode = &curcpu->c_runqueue.rq_list.tl_head;
 		while(tnode->tln_next->tln_next != NULL )
 		{
-			int head_priority =(int) curcpu->c_runqueue.tl_head.tln_next->tln_self->priority;
+			int head_priority =(int) curcpu->c_runqueue.rq_list.tl_head.tln_next->tln_self->priority;
 			tnode = tnode->tln_next;
 			int curr_priority = tnode->tln_self->priority;
 			//kprintf("curr_priority %d\n",curr_priority);
 			if ( curr_priority < head_priority)
 			{
-				threadlist_remove(&curcpu->c_runqueue,tnode->tln_self);
-				threadlist_addhead(&curcpu->c_runqueue,tnode->tln_self);
+				threadlist_remove(&curcpu->c_runqueue.rq_list,tnode->tln_self);
+				threadlist_addhead(&curcpu->c_runqueue.rq_list,tnode->tln_self);
 			}
 		}
 	}
@@ -969,6 +1307,75 @@ schedule(void)
 }
 #endif
 
+#endif /* OPT_MLFQ */
+
+/*
+ * Use up a tick of the current thread's slice (see "Time slices"
+ * above), and with the MLFQ scheduler its allotment at its level.
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur = curthread;
+	bool expired;
+
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	if (cur->t_slice > 0) {
+		cur->t_slice--;
+	}
+	expired = (cur->t_slice == 0);
+
+#if OPT_MLFQ
+	cur->t_usage++;
+	if (cur->t_usage >= MLFQ_ALLOTMENT(cur->priority)) {
+		if (cur->priority < RUNQ_LEVELS - 1) {
+			cur->priority++;
+		}
+		cur->t_usage = 0;
+		expired = true;
+	}
+	if (!expired) {
+		/* Don't make a thread woken higher up wait for the slice */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		expired = runqueue_outranks(&curcpu->c_runqueue, cur);
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
+#endif
+
+	return expired;
+}
+
+/*
+ * Print the time slices and how many context switches each cpu has
+ * done, split into voluntary ones (yielding or sleeping) and
+ * involuntary ones (preemption).
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	kprintf("Quantum (hardclocks) by class:");
+	for (i=0; i<THREAD_CLASSES; i++) {
+		kprintf(" %u", thread_quantum[i]);
+	}
+	kprintf("\n");
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u voluntary, %u involuntary switches, "
+			"%u threads cached\n", c->c_number, c->c_nvcsw,
+			c->c_nivcsw, c->c_freethreads.tl_count);
+	}
+	kprintf("This thread: %u voluntary, %u involuntary switches\n",
+		curthread->t_nvcsw, curthread->t_nivcsw);
+}
+
 /*
  * Thread migration.
  *
@@ -985,6 +1392,10 @@ schedule(void)
  * For here and now, because we know we're running on System/161 and
  * System/161 does not (yet) model such cache effects, we'll be very
  * aggressive.
+ *
+ * Idle cpus also pull work for themselves (see thread_steal), so this
+ * mostly evens out cpus that are all busy. The counts are read without
+ * the run queue locks; they only need to be roughly right.
  */
 void
 thread_consider_migration(void)
@@ -999,12 +1410,10 @@ thread_consider_migration(void)
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
+		total_count += c->c_runqueue.rq_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			my_count = c->c_runqueue.rq_count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -1016,9 +1425,14 @@ thread_consider_migration(void)
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
+		t = runqueue_remtail(&curcpu->c_runqueue);
+		if (t == NULL) {
+			/* Counted without the lock; fewer than we thought */
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
+	to_send = i;
 	spinlock_release(&curcpu->c_runqueue_lock);
 
 	for (i=0; i < numcpus && to_send > 0; i++) {
@@ -1027,7 +1441,7 @@ thread_consider_migration(void)
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
+		while (c->c_runqueue.rq_count < one_share && to_send > 0) {
 			t = threadlist_remhead(&victims);
 			/*
 			 * Ordinarily, curthread will not appear on
@@ -1058,7 +1472,7 @@ thread_consider_migration(void)
 			}
 
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_add(&c->c_runqueue, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1082,7 +1496,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_add(&curcpu->c_runqueue, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1159,7 +1573,67 @@ wchan_sleep(struct wchan *wc)
 	/* may not sleep in an interrupt handler */
 	KASSERT(!curthread->t_in_interrupt);
 
-	thread_switch(S_SLEEP, wc);
+	thread_switch(S_SLEEP, wc, false);
+}
+
+/*
+ * A sleep with a timeout. The timeout (on the sleeper's stack) takes
+ * the thread off the channel itself, unless a wakeup got there first;
+ * both happen with the channel locked, and t_wchan says which won.
+ */
+struct wchan_timeout {
+	struct timeout wt_timeout;
+	struct thread *wt_thread;
+	struct wchan *wt_wchan;
+	bool wt_expired;
+};
+
+static
+void
+wchan_timedout(void *arg)
+{
+	struct wchan_timeout *wt = arg;
+	struct thread *target = wt->wt_thread;
+	struct wchan *wc = wt->wt_wchan;
+
+	spinlock_acquire(&wc->wc_lock);
+	if (target->t_wchan != wc) {
+		/* Already woken up */
+		spinlock_release(&wc->wc_lock);
+		return;
+	}
+	threadlist_remove(&wc->wc_threads, target);
+	target->t_wchan = NULL;
+	wt->wt_expired = true;
+	spinlock_release(&wc->wc_lock);
+
+	thread_make_runnable(target, false);
+}
+
+/*
+ * Like wchan_sleep, but give up after TICKS hardclocks (see HZ in
+ * <clock.h>) if nobody wakes the thread first. Returns 0 if it was
+ * woken and ETIMEDOUT if it gave up.
+ */
+int
+wchan_sleep_timeout(struct wchan *wc, unsigned ticks)
+{
+	struct wchan_timeout wt;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	wt.wt_thread = curthread;
+	wt.wt_wchan = wc;
+	wt.wt_expired = false;
+	timeout_init(&wt.wt_timeout, wchan_timedout, &wt);
+	timeout_set(&wt.wt_timeout, ticks);
+
+	thread_switch(S_SLEEP, wc, false);
+
+	/* Make sure it is not still going off before wt goes away */
+	timeout_cancel(&wt.wt_timeout);
+	return wt.wt_expired ? ETIMEDOUT : 0;
 }
 
 /*
@@ -1173,6 +1647,9 @@ wchan_wakeone(struct wchan *wc)
 	/* Lock the channel and grab a thread from it */
 	spinlock_acquire(&wc->wc_lock);
 	target = threadlist_remhead(&wc->wc_threads);
+	if (target != NULL) {
+		target->t_wchan = NULL;
+	}
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1204,6 +1681,7 @@ wchan_wakeall(struct wchan *wc)
 	 */
 	spinlock_acquire(&wc->wc_lock);
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
+		target->t_wchan = NULL;
 		threadlist_addtail(&list, target);
 	}
 	/*
@@ -1277,16 +1755,56 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+/*
+ * Owe SEM a V() for a mapping that did not fit in TARGET's queue, to
+ * be done once its whole TLB is flushed. The caller holds TARGET's IPI
+ * lock. Slots are taken in order and all freed together, so the first
+ * empty one ends the search.
+ */
+static
+void
+ipi_tlbshootdown_owe(struct cpu *target, struct semaphore *sem)
+{
+	unsigned i;
+
+	if (sem == NULL) {
+		return;
+	}
+	for (i=0; i<TLBSHOOTDOWN_MAX; i++) {
+		if (target->c_shootdown_owed[i] == 0 ||
+		    target->c_shootdown_sems[i] == sem) {
+			target->c_shootdown_sems[i] = sem;
+			target->c_shootdown_owed[i]++;
+			return;
+		}
+	}
+	panic("ipi_tlbshootdown: cpu%d: too many waiters\n",
+	      target->c_number);
+}
+
+void
+ipi_tlbshootdown_batch(struct cpu *target, const struct tlbshootdown *mappings,
+		       unsigned nmappings)
+{
+	unsigned i;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
+	for (i=0; i<nmappings; i++) {
+		n = target->c_numshootdown;
+		if (n == TLBSHOOTDOWN_MAX) {
+			n = target->c_numshootdown = TLBSHOOTDOWN_ALL;
+		}
+		if (n == TLBSHOOTDOWN_ALL) {
+			/* The full flush covers it; its sender still waits */
+			ipi_tlbshootdown_owe(target, mappings[i].ts_done);
+			continue;
+		}
+		target->c_shootdown[n] = mappings[i];
 		target->c_numshootdown = n+1;
 	}
 
@@ -1329,6 +1847,18 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
 			vm_tlbshootdown_all();
+			/* still run the ones we kept so waiters hear back */
+			for (i=0; i<TLBSHOOTDOWN_MAX; i++) {
+				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			}
+			/* and tell the senders of the ones we didn't */
+			for (i=0; i<TLBSHOOTDOWN_MAX; i++) {
+				while (curcpu->c_shootdown_owed[i] > 0) {
+					V(curcpu->c_shootdown_sems[i]);
+					curcpu->c_shootdown_owed[i]--;
+				}
+				curcpu->c_shootdown_sems[i] = NULL;
+			}
 		}
 		else {
 			for (i=0; i<curcpu->c_numshootdown; i++) {
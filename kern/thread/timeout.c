@@ -0,0 +1,140 @@
+/*
+ * timeout.c
+ *
+ *	Timed callbacks, on a hashed timer wheel per cpu (see timeout.h).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <timeout.h>
+
+#define TW_SLOT(tick)	((tick) & (TIMEWHEEL_SLOTS - 1))
+
+void
+timewheel_init(struct timewheel *tw)
+{
+	unsigned i;
+
+	spinlock_init(&tw->tw_lock);
+	tw->tw_now = 0;
+	tw->tw_running = NULL;
+	for (i=0; i<TIMEWHEEL_SLOTS; i++) {
+		tw->tw_slots[i] = NULL;
+	}
+}
+
+/* Take a timeout off its slot. The wheel must be locked. */
+static
+void
+timeout_unlink(struct timeout *to)
+{
+	KASSERT(to->to_prevp != NULL);
+
+	*to->to_prevp = to->to_next;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = to->to_prevp;
+	}
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+}
+
+/*
+ * The function is called with the wheel unlocked, so that it can set
+ * timeouts of its own and take locks that are held while setting
+ * them (e.g. a wchan's). Since the slot may change meanwhile, the
+ * scan starts over after each one.
+ */
+void
+timewheel_tick(struct timewheel *tw)
+{
+	struct timeout *to;
+	unsigned slot;
+
+	spinlock_acquire(&tw->tw_lock);
+	tw->tw_now++;
+	slot = TW_SLOT(tw->tw_now);
+	to = tw->tw_slots[slot];
+	while (to != NULL) {
+		if (to->to_expires != tw->tw_now) {
+			/* Due on a later lap */
+			to = to->to_next;
+			continue;
+		}
+		timeout_unlink(to);
+		tw->tw_running = to;
+		spinlock_release(&tw->tw_lock);
+
+		to->to_func(to->to_arg);
+
+		spinlock_acquire(&tw->tw_lock);
+		tw->tw_running = NULL;
+		to = tw->tw_slots[slot];
+	}
+	spinlock_release(&tw->tw_lock);
+}
+
+void
+timeout_init(struct timeout *to, void (*func)(void *), void *arg)
+{
+	to->to_next = NULL;
+	to->to_prevp = NULL;
+	to->to_wheel = NULL;
+	to->to_expires = 0;
+	to->to_func = func;
+	to->to_arg = arg;
+}
+
+void
+timeout_set(struct timeout *to, unsigned ticks)
+{
+	struct timewheel *tw = &curcpu->c_timers;
+	struct timeout **head;
+
+	KASSERT(to->to_prevp == NULL);
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	spinlock_acquire(&tw->tw_lock);
+	to->to_wheel = tw;
+	to->to_expires = tw->tw_now + ticks;
+	head = &tw->tw_slots[TW_SLOT(to->to_expires)];
+	to->to_next = *head;
+	if (to->to_next != NULL) {
+		to->to_next->to_prevp = &to->to_next;
+	}
+	to->to_prevp = head;
+	*head = to;
+	spinlock_release(&tw->tw_lock);
+}
+
+/*
+ * The function only ever runs in another cpu's timer interrupt while
+ * we are here (ours cannot interrupt it), so waiting for it to finish
+ * is a short spin.
+ */
+bool
+timeout_cancel(struct timeout *to)
+{
+	struct timewheel *tw = to->to_wheel;
+	bool pending;
+
+	if (tw == NULL) {
+		/* Never set */
+		return false;
+	}
+
+	spinlock_acquire(&tw->tw_lock);
+	while (tw->tw_running == to) {
+		spinlock_release(&tw->tw_lock);
+		spinlock_acquire(&tw->tw_lock);
+	}
+	pending = (to->to_prevp != NULL);
+	if (pending) {
+		timeout_unlink(to);
+	}
+	spinlock_release(&tw->tw_lock);
+	return pending;
+}
@@ -43,6 +43,7 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <vm.h>
 
 /*
  * Structure for a single named device.
@@ -557,6 +558,9 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	/* Executables the VM system keeps cached would keep it busy */
+	pagecache_forget();
+
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -603,6 +607,8 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+	pagecache_forget();
+
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
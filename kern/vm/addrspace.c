@@ -27,11 +27,15 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -39,6 +43,182 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/**
+ * Page table helpers.
+ * The first level is allocated with the address space; second-level
+ * tables appear on demand in pt_lookup.
+ */
+static
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	bzero(pt, sizeof(struct pagetable));
+	return pt;
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *table;
+
+	table = pt->pt_tables[PT_DIR_INDEX(vaddr)];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = kmalloc(PT_NENTRIES * sizeof(pte_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		bzero(table, PT_NENTRIES * sizeof(pte_t));
+		pt->pt_tables[PT_DIR_INDEX(vaddr)] = table;
+	}
+	return &table[PT_TABLE_INDEX(vaddr)];
+}
+
+/* Free every page and swap slot, every second-level table and the directory */
+static
+void
+pt_destroy(struct pagetable *pt)
+{
+	pte_t *table;
+	int d, t;
+
+	for (d = 0; d < PT_NENTRIES; d++) {
+		table = pt->pt_tables[d];
+		if (table == NULL) {
+			continue;
+		}
+		for (t = 0; t < PT_NENTRIES; t++) {
+			if (table[t] != 0) {
+				pte_free(&table[t]);
+			}
+		}
+		kfree(table);
+	}
+	kfree(pt);
+}
+
+/*
+ * Write back the pages from LO to HI of a shared file mapping. Returns
+ * the first error, but goes on with the rest.
+ */
+static
+int
+region_writeback(struct region *reg, vaddr_t lo, vaddr_t hi)
+{
+	vaddr_t va;
+	int result, err = 0;
+
+	KASSERT(reg->vn != NULL && reg->shared);
+
+	for (va = lo; va < hi; va += PAGE_SIZE) {
+		result = pagecache_writeback(reg->vn,
+					     reg->offset + (va - reg->viraddress));
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
+}
+
+/* Free a region, letting go of the file if it is a mapping */
+static
+void
+region_free(struct region *reg)
+{
+	if (reg->vn != NULL) {
+		VOP_DECREF(reg->vn);
+	}
+	kfree(reg);
+}
+
+/* End of a region: the first address past it */
+static
+vaddr_t
+region_end(struct region *reg)
+{
+	return reg->viraddress + reg->numpages * PAGE_SIZE;
+}
+
+/* Index of the first region starting at or above VADDR (binary search) */
+static
+unsigned
+region_search(struct regionarray *a, vaddr_t vaddr)
+{
+	unsigned lo = 0, hi = regionarray_num(a), mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (regionarray_get(a, mid)->viraddress < vaddr) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Highest region overlapping the pages from START to END, or NULL.
+ * Regions do not overlap each other, so only the last one to start
+ * below END can.
+ */
+static
+struct region *
+region_overlapping(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct region *reg;
+	unsigned i;
+
+	i = region_search(as->regions, end);
+	if (i == 0) {
+		return NULL;
+	}
+	reg = regionarray_get(as->regions, i - 1);
+	return region_end(reg) > start ? reg : NULL;
+}
+
+/* Put a region in its place in the sorted array */
+static
+int
+region_insert(struct addrspace *as, struct region *reg)
+{
+	unsigned i, pos, num;
+	int result;
+
+	num = regionarray_num(as->regions);
+	pos = region_search(as->regions, reg->viraddress);
+	result = regionarray_setsize(as->regions, num + 1);
+	if (result) {
+		return result;
+	}
+	for (i = num; i > pos; i--) {
+		regionarray_set(as->regions, i,
+				regionarray_get(as->regions, i - 1));
+	}
+	regionarray_set(as->regions, pos, reg);
+	return 0;
+}
+
+/* Take out the region at index I (but do not free it) */
+static
+void
+region_remove(struct addrspace *as, unsigned i)
+{
+	if (as->lastregion == regionarray_get(as->regions, i)) {
+		as->lastregion = NULL;
+	}
+	regionarray_remove(as->regions, i);
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -52,45 +232,97 @@ as_create(void)
 	/*
 	 * Initialize as needed.
 	 */
-	as->table = NULL;
-	as->reg = NULL;
+	as->table = pt_create();
+	if (as->table == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->regions = regionarray_create();
+	if (as->regions == NULL) {
+		pt_destroy(as->table);
+		kfree(as);
+		return NULL;
+	}
+	as->lastregion = NULL;
+	as->loading = false;
 	as->sbase = 0;
 	as->stop = 0;
+	as->hbase = 0;
+	as->htop = 0;
+	as->seqnext = 0;
+	as->seqrun = 0;
+	as->asid = 0;
+	as->asid_generation = 0;
+	as->asid_cpu = NULL;
 	return as;
 }
 
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
-	struct addrspace *newas;
+	struct addrspace *new;
+	struct region *newreg;
+	pte_t *table, *newpte;
+	unsigned i;
+	int d, t;
 
-	newas = as_create();
-	if (newas==NULL) {
+	new = as_create();
+	if (new==NULL) {
 		return ENOMEM;
 	}
-	struct addrspace *new;
-	int numRegTab = 0;
-		new = as_create();
-		if (new==NULL) {
+	new->hbase = old->hbase;
+	new->htop = old->htop;
+	new->sbase = old->sbase;
+	new->stop = old->stop;
+
+	/* Already sorted, so they can just be appended */
+	for (i = 0; i < regionarray_num(old->regions); i++) {
+		newreg = kmalloc(sizeof(struct region));
+		if (newreg == NULL) {
+			as_destroy(new);
 			return ENOMEM;
 		}
-		new->hbase = old->hbase;
-		new->htop = old->htop;
-		new->sbase = old->sbase;
-		new->stop = old->stop;
-		while(old->reg != NULL)
-		{
-			numRegTab++;
+		*newreg = *regionarray_get(old->regions, i);
+		if (regionarray_add(new->regions, newreg, NULL)) {
+			kfree(newreg);
+			as_destroy(new);
+			return ENOMEM;
+		}
+		if (newreg->vn != NULL) {
+			VOP_INCREF(newreg->vn);
+		}
+	}
+
+	/*
+	 * Share every frame and swap slot copy-on-write instead of
+	 * copying it. Only the page tables are duplicated here; vm_fault
+	 * copies a page the first time either side writes to it.
+	 */
+	for (d = 0; d < PT_NENTRIES; d++) {
+		table = old->table->pt_tables[d];
+		if (table == NULL) {
+			continue;
 		}
-		memmove(new->reg,old->reg,(sizeof(struct region)* numRegTab));
-		numRegTab = 0;
-		while(old->table != NULL)
-		{
-			numRegTab++;
+		for (t = 0; t < PT_NENTRIES; t++) {
+			if (table[t] == 0) {
+				continue;
+			}
+			newpte = pt_lookup(new->table, PT_VADDR(d, t), true);
+			if (newpte == NULL) {
+				as_destroy(new);
+				return ENOMEM;
+			}
+			pte_share(&table[t], newpte);
 		}
-		memmove(new->table,old->table,(sizeof(struct pagetable)* numRegTab));
-		numRegTab = 0;
-		*ret = newas;
+	}
+
+	/*
+	 * The TLB may still hold writeable translations for pages that
+	 * are now shared; drop them so the next write faults.
+	 */
+	vm_tlbflush(old);
+
+	*ret = new;
 	return 0;
 }
 
@@ -101,26 +333,26 @@ as_destroy(struct addrspace *as)
 	 * Clean up as needed.
 	 */
 	struct region *reg;
-	struct pagetable *page;
+	unsigned i;
 
-		while (as->reg != NULL)
-		{
-			reg = as->reg;
-			as->reg = as->reg->next;
-			kfree(reg);
-		}
-
-		while(as->table != NULL)
-		{
-			page = as->table;
-			if(page->phyaddress != 0)
-			{
-				page_free(page->phyaddress);
-				as->table = as->table->next;
-				kfree(page);
-			}
+	/*
+	 * Unmap everything first, so that the pages of shared file
+	 * mappings that nobody else maps come out clean when written
+	 * back. There is nobody to report a failed write to.
+	 */
+	pt_destroy(as->table);
 
+	for (i = 0; i < regionarray_num(as->regions); i++) {
+		reg = regionarray_get(as->regions, i);
+		if (reg->vn != NULL && reg->shared) {
+			(void)region_writeback(reg, reg->viraddress,
+					       region_end(reg));
 		}
+		region_free(reg);
+	}
+	regionarray_setsize(as->regions, 0);
+	regionarray_destroy(as->regions);
+
 	kfree(as);
 }
 
@@ -128,11 +360,13 @@ void
 as_activate(struct addrspace *as)
 {
 	/*
-	 * Write this.
+	 * Entries are tagged with the address space's ASID, so there is
+	 * no need to throw the TLB away; just switch ASIDs.
 	 */
-
-	(void)as;  // suppress warning until code gets written
-	vm_tlbshootdown_all();
+	if (as == NULL) {
+		return;
+	}
+	vm_activate(as);
 }
 
 /*
@@ -141,123 +375,367 @@ as_activate(struct addrspace *as)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. vm_fault
+ * enforces them once the program is loaded; the MIPS cannot tell
+ * reading from executing, so readable and executable are the same
+ * to it. Segments may share a page at their ends, and a page belongs
+ * to one region only, so overlapping segments make one region with the
+ * permissions of both.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-
-	struct region *reg,*tmp;
+	struct region *reg, *old;
+	vaddr_t end;
+	int prot;
 
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME; //Aligning Regions
 	vaddr &= PAGE_FRAME;
 
-		/* ...and now the length. */
+	/* ...and now the length. */
 	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	end = vaddr + sz;
 
-		// Update heap_start
-	as->hbase = vaddr + (sz/PAGE_SIZE) * PAGE_SIZE;
-	as->htop = vaddr + (sz/PAGE_SIZE) * PAGE_SIZE;
-
-		// Record region (to be used in vm_fault)
-		reg = kmalloc(sizeof(struct region));
-		if (reg == NULL)return ENOMEM;
-		reg->viraddress = vaddr;
-		reg->numpages = sz / PAGE_SIZE;
-		/*reg->readable = readable;
-		reg->writeable = writeable;
-		reg->executable = executable;*/
-		if(as->reg == NULL)
-			{
-				as->reg = reg;
-			}
-		else
-			{
-				tmp = as->reg;
-				while(tmp->next != NULL)
-				{
-					tmp = tmp->next;
-				}
-				tmp->next = reg;
-			}
-		return 0;
+	prot = (readable ? PROT_READ : 0) | (writeable ? PROT_WRITE : 0) |
+		(executable ? PROT_EXEC : 0);
+
+	while ((old = region_overlapping(as, vaddr, end)) != NULL) {
+		KASSERT(old->vn == NULL);
+		if (old->viraddress < vaddr) {
+			vaddr = old->viraddress;
+		}
+		if (region_end(old) > end) {
+			end = region_end(old);
+		}
+		prot |= old->prot;
+		region_remove(as, region_search(as->regions, old->viraddress));
+		region_free(old);
+	}
+
+	// Heap starts right after the highest region
+	if (end > as->hbase)
+	{
+		as->hbase = end;
+		as->htop = end;
+	}
+
+	// Record region (to be used in vm_fault)
+	reg = kmalloc(sizeof(struct region));
+	if (reg == NULL)return ENOMEM;
+	reg->viraddress = vaddr;
+	reg->numpages = (end - vaddr) / PAGE_SIZE;
+	reg->vn = NULL;
+	reg->offset = 0;
+	reg->filesize = 0;
+	reg->prot = prot;
+	reg->shared = false;
+	reg->mmapped = false;
+	if (region_insert(as, reg)) {
+		kfree(reg);
+		return ENOMEM;
+	}
+	return 0;
 }
 
+/*
+ * A segment can be mapped if its file system lets VN be mapped, it has
+ * its region to itself (it shares no page with another segment), and
+ * it sits at the same place within a page in the file as in memory, so
+ * that each page of the region is (the start of) a page of the file.
+ * The first page may then show file bytes from before the segment,
+ * such as the ELF headers.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_map_segment(struct addrspace *as, vaddr_t vaddr, size_t memsz,
+	       struct vnode *vn, off_t offset, size_t filesz)
 {
-	/*
-	 * Write this.
-	 */
 	struct region *reg;
-	struct pagetable *page,*temp;
-	reg = as->reg;
-	while(reg!=NULL)
-	{
-		size_t i;
-		size_t cnt = reg->numpages;
-		vaddr_t reg_base = reg->viraddress;
-		temp = as->table;
-		while(temp->next != NULL)
-		{
-			temp = temp->next;
-		}
-		for(i=0;i<cnt;i++)
-		{
-		 	page = (struct pagetable *)kmalloc(sizeof(struct pagetable));
-			KASSERT(page!=NULL);
-			//virtual address being computed according to the base address for the region.
-			page->viraddress = reg_base + i * PAGE_SIZE;
-			page->phyaddress = page_alloc();
-			page->next = NULL;
-			if(temp == NULL)
-			{
-					as->table=temp=page;
-			}
-			else
-			{
-					temp->next = page;
-					temp = temp->next;
-			}
-		}
-		reg = reg->next;
+	vaddr_t pageoff = vaddr & ~(vaddr_t)PAGE_FRAME;
+
+	KASSERT(filesz <= memsz);
+
+	if (offset % PAGE_SIZE != (off_t)pageoff) {
+		return EINVAL;
 	}
+	reg = as_find_region(as, vaddr);
+	if (reg == NULL || reg->vn != NULL ||
+	    reg->viraddress != vaddr - pageoff ||
+	    region_end(reg) != ROUNDUP(vaddr + memsz, PAGE_SIZE)) {
+		return EINVAL;
+	}
+	if (VOP_MMAP(vn) != 0) {
+		return EINVAL;
+	}
+
+	reg->vn = vn;
+	reg->offset = offset - pageoff;
+	reg->filesize = pageoff + filesz;
+	VOP_INCREF(vn);
 	return 0;
 }
 
 int
-as_complete_load(struct addrspace *as)
+as_prepare_load(struct addrspace *as)
 {
 	/*
-	 * Write this.
+	 * Pages are allocated by vm_fault the first time load_elf (or the
+	 * program) touches them. load_elf has to be able to write the
+	 * segments it copies in, whatever their permissions.
 	 */
+	as->loading = true;
+	return 0;
+}
 
-	(void)as;
+int
+as_complete_load(struct addrspace *as)
+{
+	/* Drop the writeable translations load_elf left behind */
+	as->loading = false;
+	vm_tlbflush(as);
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	/* The stack grows down from USERSTACK and is filled on demand */
+	as->stop = USERSTACK;
+	as->sbase = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
 
 	/* Initial user-level stack pointer */
-	as->sbase = USERSTACK;
-	as->stop =USERSTACK;
 	*stackptr = USERSTACK;
 	
 	return 0;
 }
 
+bool
+as_valid_addr(struct addrspace *as, vaddr_t vaddr)
+{
+	/* The break need not be page-aligned; its last page is all heap */
+	if (vaddr >= as->hbase && vaddr < ROUNDUP(as->htop, PAGE_SIZE)) {
+		return true;
+	}
+	if (vaddr >= as->sbase && vaddr < as->stop) {
+		return true;
+	}
+	return as_find_region(as, vaddr) != NULL;
+}
+
+/*
+ * Faults tend to come in runs on one region, so the last region found
+ * is tried before searching.
+ */
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *reg = as->lastregion;
+
+	if (reg != NULL && vaddr >= reg->viraddress && vaddr < region_end(reg)) {
+		return reg;
+	}
+	reg = region_overlapping(as, vaddr, vaddr + 1);
+	if (reg != NULL) {
+		as->lastregion = reg;
+	}
+	return reg;
+}
+
+/*
+ * Program regions all lie below hbase and mappings above it, so the
+ * first region at or above hbase is the lowest mapping.
+ */
+vaddr_t
+as_heaplimit(struct addrspace *as)
+{
+	unsigned i;
+
+	i = region_search(as->regions, as->hbase);
+	if (i < regionarray_num(as->regions)) {
+		return regionarray_get(as->regions, i)->viraddress;
+	}
+	return as->sbase;
+}
+
+/*
+ * Mappings are placed top-down from the stack, in the highest hole
+ * that fits above the heap as it is now; sbrk does not grow the heap
+ * past the lowest of them.
+ */
+int
+as_map_file(struct addrspace *as, size_t len, struct vnode *vn,
+	    off_t offset, int prot, bool shared, vaddr_t *ret)
+{
+	struct region *reg;
+	vaddr_t top, start, heapend;
+
+	KASSERT(len > 0 && len % PAGE_SIZE == 0);
+
+	heapend = ROUNDUP(as->htop, PAGE_SIZE);
+	top = as->sbase;
+	for (;;) {
+		if (top < heapend || top - heapend < len) {
+			return ENOMEM;
+		}
+		start = top - len;
+		reg = region_overlapping(as, start, top);
+		if (reg == NULL) {
+			break;
+		}
+		top = reg->viraddress;
+	}
+
+	reg = kmalloc(sizeof(struct region));
+	if (reg == NULL) {
+		return ENOMEM;
+	}
+	reg->viraddress = start;
+	reg->numpages = len / PAGE_SIZE;
+	reg->vn = vn;
+	reg->offset = offset;
+	reg->filesize = len;
+	reg->prot = prot;
+	reg->shared = shared;
+	reg->mmapped = true;
+	if (region_insert(as, reg)) {
+		kfree(reg);
+		return ENOMEM;
+	}
+	VOP_INCREF(vn);
+
+	*ret = start;
+	return 0;
+}
+
+/* Index of the first region that may overlap pages from VADDR on */
+static
+unsigned
+region_first(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned i;
+
+	i = region_search(as->regions, vaddr);
+	if (i > 0 && region_end(regionarray_get(as->regions, i - 1)) > vaddr) {
+		i--;
+	}
+	return i;
+}
+
+/*
+ * Parts of the range that are not file mappings are left alone. A
+ * mapping the range cuts in two becomes two mappings.
+ */
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *reg, *tailreg;
+	vaddr_t end = vaddr + len, regend, lo, hi, va;
+	pte_t *pte;
+	bool freed;
+	unsigned i;
+	int result, err = 0;
+
+	i = region_first(as, vaddr);
+	while (i < regionarray_num(as->regions)) {
+		reg = regionarray_get(as->regions, i);
+		if (reg->viraddress >= end) {
+			break;
+		}
+		if (!reg->mmapped) {
+			i++;
+			continue;
+		}
+		regend = region_end(reg);
+		lo = vaddr > reg->viraddress ? vaddr : reg->viraddress;
+		hi = end < regend ? end : regend;
+
+		if (lo > reg->viraddress && hi < regend) {
+			tailreg = kmalloc(sizeof(struct region));
+			if (tailreg == NULL) {
+				return ENOMEM;
+			}
+			*tailreg = *reg;
+			tailreg->viraddress = hi;
+			tailreg->numpages = (regend - hi) / PAGE_SIZE;
+			tailreg->offset = reg->offset + (hi - reg->viraddress);
+			tailreg->filesize = regend - hi;
+			if (region_insert(as, tailreg)) {
+				kfree(tailreg);
+				return ENOMEM;
+			}
+			VOP_INCREF(tailreg->vn);
+			regend = hi;
+		}
+
+		freed = false;
+		for (va = lo; va < hi; va += PAGE_SIZE) {
+			pte = pt_lookup(as->table, va, false);
+			if (pte != NULL && *pte != 0) {
+				pte_free(pte);
+				freed = true;
+			}
+		}
+		if (freed) {
+			/* Before writeback, which must see them unmapped */
+			vm_tlbflush(as);
+		}
+		if (reg->shared) {
+			result = region_writeback(reg, lo, hi);
+			if (result && err == 0) {
+				err = result;
+			}
+		}
+
+		if (lo == reg->viraddress && hi == regend) {
+			region_remove(as, i);
+			region_free(reg);
+			continue;
+		}
+		if (lo == reg->viraddress) {
+			reg->offset += hi - lo;
+			reg->viraddress = hi;
+			reg->numpages = (regend - hi) / PAGE_SIZE;
+		}
+		else {
+			reg->numpages = (lo - reg->viraddress) / PAGE_SIZE;
+		}
+		reg->filesize = reg->numpages * PAGE_SIZE;
+		i++;
+	}
+	return err;
+}
+
+int
+as_sync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *reg;
+	vaddr_t end = vaddr + len, lo, hi, va;
+	unsigned i;
+	int result, err = 0;
+
+	/* All of the range has to be mapped */
+	for (va = vaddr; va < end; va += PAGE_SIZE) {
+		reg = as_find_region(as, va);
+		if (reg == NULL || !reg->mmapped) {
+			return ENOMEM;
+		}
+	}
+
+	for (i = region_first(as, vaddr); i < regionarray_num(as->regions);
+	     i++) {
+		reg = regionarray_get(as->regions, i);
+		if (reg->viraddress >= end) {
+			break;
+		}
+		if (!reg->shared) {
+			continue;
+		}
+		lo = vaddr > reg->viraddress ? vaddr : reg->viraddress;
+		hi = end < region_end(reg) ? end : region_end(reg);
+		result = region_writeback(reg, lo, hi);
+		if (result && err == 0) {
+			err = result;
+		}
+	}
+	return err;
+}
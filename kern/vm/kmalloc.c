@@ -29,7 +29,11 @@
 
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <thread.h>
+#include <current.h>
 #include <vm.h>
 
 /*
@@ -118,69 +122,102 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Use one spinlock for the pages and their lists. Most kmalloc and
+ * kfree calls never take it, though: they are served from per-cpu
+ * magazines (below), and only go to the pages to refill or flush one.
+ */
+
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs come from whole pages of them. The first page is in the
+ * kernel BSS, so the heap can start up before alloc_kpages works; when
+ * that runs out we get more pages of them from alloc_kpages, so the
+ * size of the heap is only limited by memory. Free pagerefs are kept
+ * on a list threaded through next_samesize, which makes both allocating
+ * and freeing one O(1).
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pages of pagerefs are never given back. One page covers 256 pages
+ * (1M) of heap, so this costs at most 1/256 of the biggest the heap
+ * has ever been.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
 static struct pageref pagerefs[NPAGEREFS];
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *pagerefs_free;
+static unsigned pagerefs_total;	/* pagerefs we have, free or not */
+static unsigned pagerefs_inuse;	/* pagerefs allocated */
+static bool pagerefs_ready;	/* pagerefs[] is on the free list */
 
+/* Put a page of fresh pagerefs on the free list */
+static
+void
+addpagerefs(struct pageref *chunk)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<NPAGEREFS; i++) {
+		chunk[i].next_samesize = pagerefs_free;
+		pagerefs_free = &chunk[i];
+	}
+	pagerefs_total += NPAGEREFS;
+}
+
+/*
+ * Get a pageref. Called with kmalloc_spinlock held, but if there are
+ * no free pagerefs the lock is dropped to get another page of them, so
+ * (as in subpage_getblocks) things can change behind our back.
+ */
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-
-	DEBUG(DB_KMALLOC, "Allocating Page Reference ..... ");
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			DEBUG(DB_KMALLOC, "Virtual Memory is full. All pages are being used...");
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+	struct pageref *pr;
+	vaddr_t chunk;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (!pagerefs_ready) {
+		addpagerefs(pagerefs);
+		pagerefs_ready = true;
+	}
+
+	while (pagerefs_free == NULL) {
+		DEBUG(DB_KMALLOC, "kmalloc: out of pagerefs, getting more\n");
+		spinlock_release(&kmalloc_spinlock);
+		chunk = alloc_kpages(1);
+		spinlock_acquire(&kmalloc_spinlock);
+		if (chunk == 0) {
+			if (pagerefs_free != NULL) {
+				/* Someone else got some meanwhile */
+				break;
 			}
+			return NULL;
 		}
-		KASSERT(0);
+		addpagerefs((struct pageref *)chunk);
 	}
 
-	/* ran out */
-	return NULL;
+	pr = pagerefs_free;
+	pagerefs_free = pr->next_samesize;
+	pagerefs_inuse++;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pagerefs_inuse > 0);
+
+	p->next_samesize = pagerefs_free;
+	pagerefs_free = p;
+	pagerefs_inuse--;
 	DEBUG(DB_VM, "VM Page references freed ");
 }
 
@@ -191,14 +228,64 @@ static struct pageref *allbase;
 
 ////////////////////////////////////////
 
+//
+// Per-cpu magazines.
+//
+//    In front of the pages, each cpu keeps a small stack of free blocks
+//    (a "magazine") of every size. kmalloc and kfree of subpage blocks
+//    normally just pop or push the current cpu's magazine with
+//    interrupts off, which is enough to keep everything else on that
+//    cpu away from it. kmalloc_spinlock is taken only to refill an
+//    empty magazine or flush a full one, half a magazine at a time.
+//
+//    Blocks in a magazine still count as allocated as far as their page
+//    is concerned, so a page only goes back to the VM system once its
+//    blocks have drained out of the magazines. To bound the memory tied
+//    up that way, magazines of big blocks hold fewer of them.
+//
+//    kfree finds the page a block is on through the tag kmalloc puts on
+//    the page's coremap entry, without a lock. Pages allocated before
+//    the VM system was up have no coremap entry and so no tag; their
+//    blocks bypass the magazines and are looked up the slow way.
+//
+
+#define MAG_ROUNDS   16	/* most blocks one magazine holds */
+#define MAG_MAXCPUS  32	/* cpus beyond this many go without */
+
+struct magazine {
+	void *rounds[MAG_ROUNDS];
+	unsigned nrounds;
+
+	/* Statistics for kheap_printstats */
+	unsigned allocs, alloc_hits;
+	unsigned frees, free_hits;
+};
+
+static struct magazine magazines[MAG_MAXCPUS][NSIZES];
+
+/* How many blocks of type blktype a magazine holds: two pages' worth */
+static
+unsigned
+maglimit(unsigned blktype)
+{
+	unsigned n = 2*PAGE_SIZE / sizes[blktype];
+
+	return n < MAG_ROUNDS ? n : MAG_ROUNDS;
+}
+
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * The current cpu's magazine for blktype, or NULL if it has none.
+ * Interrupts must be off, so that we stay on this cpu while using it.
  */
-
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static
+struct magazine *
+curmagazine(unsigned blktype)
+{
+	if (!CURCPU_EXISTS() || curcpu->c_number >= MAG_MAXCPUS) {
+		return NULL;
+	}
+	return &magazines[curcpu->c_number][blktype];
+}
 
 ////////////////////////////////////////
 
@@ -265,14 +352,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < pagerefs_inuse);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < pagerefs_inuse);
 		ac++;
 	}
 
@@ -335,23 +422,6 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
-void
-kheap_printstats(void)
-{
-	struct pageref *pr;
-
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
-
-	kprintf("Subpage allocator status:\n");
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
-	}
-
-	spinlock_release(&kmalloc_spinlock);
-}
-
 ////////////////////////////////////////
 
 static
@@ -397,64 +467,129 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of page pr, which must have one free.
+ * Call with kmalloc_spinlock held.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_popblock(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
 
-	spinlock_acquire(&kmalloc_spinlock);
+	return retptr;
+}
 
-	checksubpages();
+/*
+ * Put a block back on the freelist of page pr. If that leaves the whole
+ * page free, take the page off the lists, release its pageref and
+ * return true; the caller then hands the page back with free_kpages,
+ * after dropping kmalloc_spinlock. Call with kmalloc_spinlock held.
+ */
+static
+bool
+subpage_pushblock(struct pageref *pr, void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
+	KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fl = (struct freelist *)ptr;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		remove_lists(pr, blktype);
+		kpage_settag(prpage, NULL);
+		freepageref(pr);
+		return true;
+	}
+	return false;
+}
 
-		if (pr->nfree > 0) {
+/*
+ * Take up to n free blocks of type blktype from the pages, making a
+ * fresh page if none has any. Returns how many were taken into
+ * blocks[]; 0 means we are out of memory.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned n)
+{
+	struct pageref *pr;	// pageref for page we're allocating from
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	unsigned got = 0;	// blocks taken so far
 
-		doalloc: /* comes here after getting a whole fresh page */
+	volatile int i;
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	KASSERT(n > 0);
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+	spinlock_acquire(&kmalloc_spinlock);
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+	checksubpages();
 
-			checksubpages();
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+
+		while (pr->nfree > 0 && got < n) {
+			blocks[got++] = subpage_popblock(pr);
 		}
 	}
 
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -468,8 +603,8 @@ subpage_kmalloc(size_t sz)
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
-		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		kprintf("kmalloc: Subpage allocator couldn't get a page\n");
+		return 0;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -478,8 +613,8 @@ subpage_kmalloc(size_t sz)
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		kprintf("kmalloc: Subpage allocator couldn't get pageref\n");
+		return 0;
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -509,20 +644,117 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	kpage_settag(prpage, pr);
+
+	while (pr->nfree > 0 && got < n) {
+		blocks[got++] = subpage_popblock(pr);
+	}
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return got;
+}
+
+/*
+ * Give n blocks, all on tagged pages, back to their pages, and any
+ * pages that become free back to the VM system.
+ */
+static
+void
+subpage_putblocks(void **blocks, unsigned n)
+{
+	vaddr_t freepages[MAG_ROUNDS];
+	unsigned nfreepages = 0;
+	struct pageref *pr;
+	unsigned i;
+
+	KASSERT(n <= MAG_ROUNDS);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	for (i=0; i<n; i++) {
+		pr = kpage_gettag((vaddr_t)blocks[i]);
+		KASSERT(pr != NULL);
+		checksubpage(pr);
+		if (subpage_pushblock(pr, blocks[i])) {
+			freepages[nfreepages++] = PR_PAGEADDR(pr);
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct magazine *mag;	// this cpu's magazine for blktype
+	void *blocks[MAG_ROUNDS];	// refill from the pages
+	void *retptr;		// our result
+	unsigned n;
+	int spl;
+
+	blktype = blocktype(sz);
+
+	spl = splhigh();
+	mag = curmagazine(blktype);
+	if (mag != NULL) {
+		mag->allocs++;
+		if (mag->nrounds > 0) {
+			mag->alloc_hits++;
+			retptr = mag->rounds[--mag->nrounds];
+			splx(spl);
+			return retptr;
+		}
+	}
+	splx(spl);
+
+	/*
+	 * Magazine empty: get a block, and half a magazine more to load
+	 * it with, in one trip to the pages.
+	 */
+	n = subpage_getblocks(blktype, blocks,
+			      mag == NULL ? 1 : maglimit(blktype)/2 + 1);
+	if (n == 0) {
+		return NULL;
+	}
+	retptr = blocks[--n];
+
+	if (n > 0) {
+		/* We may be on another cpu by now; load whichever we're on */
+		spl = splhigh();
+		mag = curmagazine(blktype);
+		while (mag != NULL && n > 0 && mag->nrounds < maglimit(blktype)) {
+			mag->rounds[mag->nrounds++] = blocks[--n];
+		}
+		splx(spl);
+
+		if (n > 0) {
+			subpage_putblocks(blocks, n);
+		}
+	}
+
+	return retptr;
 }
 
+/*
+ * Free a block on a page allocated before the VM system was up, which
+ * has no tag, the slow way: search for its page.
+ */
 static
 int
-subpage_kfree(void *ptr)
+subpage_kfree_untagged(void *ptr)
 {
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
@@ -562,26 +794,7 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	if (subpage_pushblock(pr, ptr)) {
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -590,33 +803,261 @@ subpage_kfree(void *ptr)
 		spinlock_release(&kmalloc_spinlock);
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	return 0;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	vaddr_t ptraddr;	// same as ptr
+	struct pageref *pr;	// pageref for page we're freeing in
+	struct magazine *mag;	// this cpu's magazine for blktype
+	void *blocks[MAG_ROUNDS];	// flushed to the pages
+	unsigned n = 0;
+	int spl;
+
+	ptraddr = (vaddr_t)ptr;
+
+	/*
+	 * The page's tag cannot change under us: the page stays ours at
+	 * least until this block is back on it.
+	 */
+	pr = kpage_gettag(ptraddr);
+	if (pr == NULL) {
+		return subpage_kfree_untagged(ptr);
+	}
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+
+	/* Check for proper positioning and alignment */
+	if ((ptraddr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	mag = curmagazine(blktype);
+	if (mag != NULL) {
+		mag->frees++;
+		if (mag->nrounds < maglimit(blktype)) {
+			mag->free_hits++;
+			mag->rounds[mag->nrounds++] = ptr;
+			splx(spl);
+			return 0;
+		}
+		/* Magazine full: flush half of it along with this block */
+		while (n < maglimit(blktype)/2) {
+			blocks[n++] = mag->rounds[--mag->nrounds];
+		}
+	}
+	splx(spl);
+
+	blocks[n++] = ptr;
+	subpage_putblocks(blocks, n);
 
 	return 0;
 }
 
 //
 ////////////////////////////////////////////////////////////
+//
+// Large allocator.
+//
+//    Blocks of LARGEST_SUBPAGE_SIZE and up are whole pages from
+//    alloc_kpages, which gives back whatever its buddy block has past
+//    the pages asked for, so a block costs exactly its own pages. The
+//    size classes are exact page counts to keep it that way: one per
+//    count up to LARGE_MAXPAGES, and "huge" for anything bigger.
+//
+//    A block's size is recorded in the coremap rather than in a header,
+//    which would push a one-page block onto a second page: the block's
+//    first page is tagged with its class, the way subpage pages are
+//    tagged with their pageref. kfree tells the two apart by what the
+//    tag points to, so it needs no search.
+//
+//    The last few blocks freed (up to LARGE_CACHE_PAGES pages in all)
+//    are kept on their class to be handed out again, so that thread
+//    stacks and path buffers which come and go do not go back and
+//    forth to the VM system every time.
+//
+
+#define LARGE_MAXPAGES    8
+#define NLARGE            (LARGE_MAXPAGES+1)	/* 1-8 pages, and huge */
+#define LARGE_HUGE        (NLARGE-1)
+#define LARGE_CACHE_PAGES 16
+
+struct largeclass {
+	unsigned lc_npages;		/* pages per block; 0 if huge */
+	struct freelist *lc_cache;	/* recently freed blocks */
+	unsigned lc_ncached;
+
+	/* Statistics for kheap_printstats */
+	unsigned lc_allocs, lc_hits, lc_frees;
+};
+
+/* Protects the caches and statistics in largeclasses[] */
+static struct spinlock large_spinlock = SPINLOCK_INITIALIZER;
+
+static struct largeclass largeclasses[NLARGE] = {
+	{ 1, NULL, 0, 0, 0, 0 },
+	{ 2, NULL, 0, 0, 0, 0 },
+	{ 3, NULL, 0, 0, 0, 0 },
+	{ 4, NULL, 0, 0, 0, 0 },
+	{ 5, NULL, 0, 0, 0, 0 },
+	{ 6, NULL, 0, 0, 0, 0 },
+	{ 7, NULL, 0, 0, 0, 0 },
+	{ 8, NULL, 0, 0, 0, 0 },
+	{ 0, NULL, 0, 0, 0, 0 },
+};
+static unsigned large_cachedpages;
+
+/* The size class a page tag names, or NULL if it is not a large block */
+static
+struct largeclass *
+large_fromtag(void *tag)
+{
+	struct largeclass *lc = tag;
+
+	if (lc >= &largeclasses[0] && lc < &largeclasses[NLARGE]) {
+		return lc;
+	}
+	return NULL;
+}
 
+static
 void *
-kmalloc(size_t sz)
+large_kmalloc(size_t sz)
 {
-	if (sz>=LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
+	unsigned long npages;
+	struct largeclass *lc;
+	struct freelist *fl;
+	vaddr_t address;
+
+	/* Round up to a whole number of pages; that is the size class. */
+	npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
+	lc = &largeclasses[npages <= LARGE_MAXPAGES ? npages-1 : LARGE_HUGE];
+
+	spinlock_acquire(&large_spinlock);
+	lc->lc_allocs++;
+	fl = lc->lc_cache;
+	if (fl != NULL) {
+		lc->lc_cache = fl->next;
+		lc->lc_ncached--;
+		large_cachedpages -= lc->lc_npages;
+		lc->lc_hits++;
+		spinlock_release(&large_spinlock);
+		return fl;
+	}
+	spinlock_release(&large_spinlock);
 
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
+	address = alloc_kpages(npages);
+	if (address==0) {
+		return NULL;
+	}
+	kpage_settag(address, lc);
+
+	return (void *)address;
+}
+
+static
+void
+large_kfree(void *ptr, struct largeclass *lc)
+{
+	struct freelist *fl;
+
+	KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+
+	spinlock_acquire(&large_spinlock);
+	lc->lc_frees++;
+	if (lc != &largeclasses[LARGE_HUGE] &&
+	    large_cachedpages + lc->lc_npages <= LARGE_CACHE_PAGES) {
+		fl = ptr;
+		fl->next = lc->lc_cache;
+		lc->lc_cache = fl;
+		lc->lc_ncached++;
+		large_cachedpages += lc->lc_npages;
+		spinlock_release(&large_spinlock);
+		return;
+	}
+	spinlock_release(&large_spinlock);
+
+	kpage_settag((vaddr_t)ptr, NULL);
+	free_kpages((vaddr_t)ptr);
+}
+
+void
+kheap_printstats(void)
+{
+	struct pageref *pr;
+	struct magazine *mag;
+	struct largeclass *lc;
+	unsigned c, i;
+
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+
+	kprintf("Subpage allocator status:\n");
+	kprintf("%u of %u pagerefs in use\n", pagerefs_inuse, pagerefs_total);
+
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		dumpsubpage(pr);
+	}
+
+	spinlock_release(&kmalloc_spinlock);
+
+	/* The counters are per-cpu and unlocked; this is only a snapshot */
+	kprintf("Magazines:\n");
+	for (c=0; c<MAG_MAXCPUS; c++) {
+		for (i=0; i<NSIZES; i++) {
+			mag = &magazines[c][i];
+			if (mag->allocs == 0 && mag->frees == 0) {
+				continue;
+			}
+			kprintf("cpu%-2u %4lu: %u allocs %u%% hit, "
+				"%u frees %u%% hit, %u held\n",
+				c, (unsigned long) sizes[i],
+				mag->allocs,
+				mag->allocs ? mag->alloc_hits*100/mag->allocs : 0,
+				mag->frees,
+				mag->frees ? mag->free_hits*100/mag->frees : 0,
+				mag->nrounds);
 		}
+	}
 
-		return (void *)address;
+	spinlock_acquire(&large_spinlock);
+	kprintf("Large blocks: %u pages cached\n", large_cachedpages);
+	for (i=0; i<NLARGE; i++) {
+		lc = &largeclasses[i];
+		if (i == LARGE_HUGE) {
+			kprintf("huge:");
+		}
+		else {
+			kprintf("%u pg:", lc->lc_npages);
+		}
+		kprintf(" %u allocs %u%% from cache, %u frees, %u cached\n",
+			lc->lc_allocs,
+			lc->lc_allocs ? lc->lc_hits*100/lc->lc_allocs : 0,
+			lc->lc_frees, lc->lc_ncached);
+	}
+	spinlock_release(&large_spinlock);
+}
+
+//
+////////////////////////////////////////////////////////////
+
+void *
+kmalloc(size_t sz)
+{
+	if (sz>=LARGEST_SUBPAGE_SIZE) {
+		return large_kmalloc(sz);
 	}
 
 	return subpage_kmalloc(sz);
@@ -625,14 +1066,22 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
+	struct largeclass *lc;
+
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+
+	lc = large_fromtag(kpage_gettag((vaddr_t)ptr));
+	if (lc != NULL) {
+		large_kfree(ptr, lc);
+	}
+	else if (subpage_kfree(ptr)) {
+		/*
+		 * Not on any subpage page: a big allocation made before
+		 * the VM system was up, which has no tag.
+		 */
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
 }
-
@@ -0,0 +1,359 @@
+/*
+ * slab.c
+ *
+ *	Object caches. See slab.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * A slab is one page: a struct slab header, the stack of indexes of
+ * its free objects, then the objects. The header is at the start of the
+ * page, so the slab an object is on is found by rounding its address
+ * down.
+ *
+ * Free objects keep their constructed state, so unlike kmalloc's
+ * blocks they cannot have the free list threaded through them; hence
+ * the stack of indexes. Free objects that have never been constructed,
+ * or whose constructor failed, are marked SLAB_RAW on the stack.
+ */
+#define SLAB_RAW    0x8000
+#define SLAB_ALIGN  8
+
+struct slab {
+	struct kmem_cache *s_cache;
+	struct slab *s_next;
+	struct slab *s_prev;
+	unsigned s_nfree;		/* entries on s_free */
+	uint16_t s_free[];		/* stack of free object indexes */
+};
+
+struct kmem_cache {
+	char *kc_name;
+	size_t kc_size;			/* object size, rounded up */
+	unsigned kc_perslab;		/* objects per slab */
+	size_t kc_offset;		/* offset of object 0 in a slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	/*
+	 * Slabs with some objects free, slabs with none free, and one
+	 * slab with all of them free, kept back so that a cache going
+	 * back and forth across a slab boundary does not get and
+	 * construct a whole page each time.
+	 */
+	struct spinlock kc_lock;
+	struct slab *kc_partial;
+	struct slab *kc_full;
+	struct slab *kc_empty;
+
+	/* Statistics, under kc_lock */
+	unsigned kc_nslabs;
+	unsigned kc_inuse;
+	unsigned kc_allocs;
+	unsigned kc_ctors;
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+};
+
+/* All caches, for kmem_cache_printstats */
+static struct spinlock kmem_caches_lock = SPINLOCK_INITIALIZER;
+static struct kmem_cache *kmem_caches;
+
+static
+void
+slab_insert(struct slab **list, struct slab *s)
+{
+	s->s_prev = NULL;
+	s->s_next = *list;
+	if (*list != NULL) {
+		(*list)->s_prev = s;
+	}
+	*list = s;
+}
+
+static
+void
+slab_remove(struct slab **list, struct slab *s)
+{
+	if (s->s_prev != NULL) {
+		s->s_prev->s_next = s->s_next;
+	}
+	else {
+		KASSERT(*list == s);
+		*list = s->s_next;
+	}
+	if (s->s_next != NULL) {
+		s->s_next->s_prev = s->s_prev;
+	}
+	s->s_next = s->s_prev = NULL;
+}
+
+static
+void *
+slab_obj(struct kmem_cache *kc, struct slab *s, unsigned index)
+{
+	KASSERT(index < kc->kc_perslab);
+	return (char *)s + kc->kc_offset + index * kc->kc_size;
+}
+
+/* Get a page and make it a slab of raw objects */
+static
+struct slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct slab *s;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	s = (struct slab *)page;
+	s->s_cache = kc;
+	s->s_next = s->s_prev = NULL;
+	s->s_nfree = kc->kc_perslab;
+	for (i=0; i<kc->kc_perslab; i++) {
+		/* object 0 on top */
+		s->s_free[i] = (kc->kc_perslab - 1 - i) | SLAB_RAW;
+	}
+	return s;
+}
+
+/* Destruct the objects of a slab with nothing in use, and free it */
+static
+void
+slab_destroy(struct kmem_cache *kc, struct slab *s)
+{
+	unsigned i;
+
+	KASSERT(s->s_nfree == kc->kc_perslab);
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<s->s_nfree; i++) {
+			if ((s->s_free[i] & SLAB_RAW) == 0) {
+				kc->kc_dtor(slab_obj(kc, s, s->s_free[i]));
+			}
+		}
+	}
+	free_kpages((vaddr_t)s);
+}
+
+/*
+ * Put free object index e (possibly SLAB_RAW) back on slab s, and free
+ * the slab if that empties it and we already have an empty one.
+ */
+static
+void
+slab_put(struct kmem_cache *kc, struct slab *s, unsigned e)
+{
+	struct slab *freeme = NULL;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(s->s_nfree < kc->kc_perslab);
+	s->s_free[s->s_nfree++] = e;
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+
+	if (s->s_nfree == 1) {
+		slab_remove(&kc->kc_full, s);
+		slab_insert(&kc->kc_partial, s);
+	}
+	if (s->s_nfree == kc->kc_perslab) {
+		slab_remove(&kc->kc_partial, s);
+		if (kc->kc_empty == NULL) {
+			kc->kc_empty = s;
+		}
+		else {
+			freeme = s;
+			kc->kc_nslabs--;
+		}
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	/* The destructor and free_kpages may need locks of their own */
+	if (freeme != NULL) {
+		slab_destroy(kc, freeme);
+	}
+}
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	unsigned perslab;
+	size_t offset;
+
+	size = ROUNDUP(size, SLAB_ALIGN);
+
+	/* As many objects as fit along with their entries on the stack */
+	perslab = (PAGE_SIZE - sizeof(struct slab)) / (size + sizeof(uint16_t));
+	for (;;) {
+		offset = sizeof(struct slab) + perslab * sizeof(uint16_t);
+		offset = ROUNDUP(offset, SLAB_ALIGN);
+		if (offset + perslab * size <= PAGE_SIZE) {
+			break;
+		}
+		perslab--;
+	}
+	if (perslab == 0) {
+		panic("kmem_cache_create: %s: %lu-byte objects do not fit "
+		      "in a slab\n", name, (unsigned long) size);
+	}
+	KASSERT(perslab < SLAB_RAW);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+	kc->kc_name = kstrdup(name);
+	if (kc->kc_name == NULL) {
+		kfree(kc);
+		return NULL;
+	}
+	kc->kc_size = size;
+	kc->kc_perslab = perslab;
+	kc->kc_offset = offset;
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = NULL;
+	kc->kc_full = NULL;
+	kc->kc_empty = NULL;
+
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+	kc->kc_ctors = 0;
+
+	spinlock_acquire(&kmem_caches_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_caches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+
+	spinlock_acquire(&kmem_caches_lock);
+	for (kcp = &kmem_caches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&kmem_caches_lock);
+
+	if (kc->kc_empty != NULL) {
+		slab_destroy(kc, kc->kc_empty);
+	}
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc->kc_name);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct slab *s;
+	unsigned e;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	s = kc->kc_partial;
+	if (s == NULL) {
+		s = kc->kc_empty;
+		kc->kc_empty = NULL;
+		if (s == NULL) {
+			/* Get a page without the spinlock */
+			spinlock_release(&kc->kc_lock);
+			s = slab_create(kc);
+			if (s == NULL) {
+				return NULL;
+			}
+			spinlock_acquire(&kc->kc_lock);
+			kc->kc_nslabs++;
+		}
+		slab_insert(&kc->kc_partial, s);
+	}
+
+	KASSERT(s->s_nfree > 0);
+	e = s->s_free[--s->s_nfree];
+	if (s->s_nfree == 0) {
+		slab_remove(&kc->kc_partial, s);
+		slab_insert(&kc->kc_full, s);
+	}
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	if (e & SLAB_RAW) {
+		kc->kc_ctors++;
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	obj = slab_obj(kc, s, e & ~SLAB_RAW);
+	if ((e & SLAB_RAW) && kc->kc_ctor != NULL) {
+		if (kc->kc_ctor(obj)) {
+			slab_put(kc, s, e);
+			return NULL;
+		}
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct slab *s;
+	vaddr_t offset;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	s = (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+	offset = (vaddr_t)obj - (vaddr_t)s;
+	if (s->s_cache != kc || offset < kc->kc_offset ||
+	    (offset - kc->kc_offset) % kc->kc_size != 0) {
+		panic("kmem_cache_free: %s: invalid object %p\n",
+		      kc->kc_name, obj);
+	}
+
+	slab_put(kc, s, (offset - kc->kc_offset) / kc->kc_size);
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_caches_lock);
+
+	kprintf("Object caches:\n");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-12s %4lu bytes, %2u/slab: %u in use, %u slabs, "
+			"%u allocs, %u constructed\n",
+			kc->kc_name, (unsigned long) kc->kc_size,
+			kc->kc_perslab, kc->kc_inuse, kc->kc_nslabs,
+			kc->kc_allocs, kc->kc_ctors);
+	}
+
+	spinlock_release(&kmem_caches_lock);
+}
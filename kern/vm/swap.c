@@ -0,0 +1,163 @@
+/*
+ * swap.c
+ *
+ *	Swap space for evicted user pages. See swap.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+/* Raw swap device; NULL if there is no swap */
+static struct vnode *swap_vnode;
+
+/*
+ * Slot bookkeeping. swap_map has a bit set for every slot in use and
+ * swap_refs counts the page tables (or coremap entries) referring to
+ * it. Both are only touched under swap_lock, which is a spinlock so
+ * that slots can be freed while coremap_lock is held.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct bitmap *swap_map;
+static uint16_t *swap_refs;
+static uint32_t swap_nslots;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	int result;
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s, paging disabled\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result == 0 && st.st_size < PAGE_SIZE) {
+		result = ENOSPC;
+	}
+	if (result) {
+		kprintf("swap: %s: %s, paging disabled\n", SWAP_DEVICE,
+			strerror(result));
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	swap_refs = kmalloc(swap_nslots * sizeof(uint16_t));
+	if (swap_map == NULL || swap_refs == NULL) {
+		panic("swap: out of memory for %u slots\n", swap_nslots);
+	}
+	bzero(swap_refs, swap_nslots * sizeof(uint16_t));
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+}
+
+bool
+swap_enabled(void)
+{
+	return swap_vnode != NULL;
+}
+
+int
+swap_alloc(uint32_t *slot)
+{
+	unsigned index;
+	int result;
+
+	if (swap_vnode == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, &index);
+	if (result == 0) {
+		swap_refs[index] = 1;
+		*slot = index;
+	}
+	spinlock_release(&swap_lock);
+
+	return result;
+}
+
+void
+swap_share(uint32_t slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	if (swap_refs[slot] == 0xffff) {
+		panic("swap: slot %u shared too many times\n", slot);
+	}
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(uint32_t slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0) {
+		bitmap_unmark(swap_map, slot);
+	}
+	spinlock_release(&swap_lock);
+}
+
+/* Move one page between the frame at paddr and a swap slot */
+static
+int
+swap_io(uint32_t slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &ku);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &ku);
+	}
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+int
+swap_in(uint32_t slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_READ);
+}
+
+int
+swap_out(uint32_t slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_WRITE);
+}
@@ -29,6 +29,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/vmstat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -38,7 +40,13 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <synch.h>
+#include <wchan.h>
+#include <cpu.h>
 #include <clock.h>
+#include <swap.h>
+#include <uio.h>
+#include <stat.h>
+#include <vnode.h>
 
 /*
  * Working VM which is carved out of VM assignment :)
@@ -53,7 +61,309 @@
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
-struct lock *lock_coremap = NULL;
+/*
+ * Protects the coremap and the buddy free lists. This is a spinlock
+ * rather than a sleep lock because alloc_kpages may be called from
+ * places that cannot sleep; nothing slow is done while holding it.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/* Set once vm_bootstrap has built the coremap */
+static bool coremap_ready = false;
+
+/*
+ * Buddy allocator over the coremap.
+ *
+ * Every page from coremap_base up to page_num is managed by the buddy
+ * allocator. freeblocks[k] is a doubly linked list of free blocks of
+ * 2^k contiguous pages; the head page of each free block records its
+ * order. Block positions are relative to coremap_base, so a block of
+ * order k always starts at a multiple of 2^k and its buddy is found by
+ * flipping bit k of its relative index.
+ */
+static paddr_t coremap_paddr;
+static uint32_t coremap_base;
+static struct page *freeblocks[PAGE_MAXORDER + 1];
+static uint32_t coremap_nfree;
+
+/*
+ * Paging. Threads that find a page busy sleep on coremap_wchan until
+ * whoever is paging it is done. Evictions are serialized by evict_lock,
+ * so the clock hand and shootdown_sem (which collects acknowledgements
+ * from the other CPUs) belong to whoever holds it.
+ */
+static struct wchan *coremap_wchan;
+static struct lock *evict_lock;
+static struct semaphore *shootdown_sem;
+static uint32_t clock_hand;
+
+/*
+ * Pool of free pages that are already zero-filled. Idle CPUs take
+ * pages out of the buddy allocator and zero them (vm_zero_idle), so
+ * that allocations wanting a zeroed page find one ready. Pooled pages
+ * are ZEROED and linked through next_free; protected by coremap_lock.
+ * The pool is given back whenever the buddy allocator runs short.
+ */
+#define ZEROPOOL_MAX 64
+static struct page *zeropool;
+static uint32_t zeropool_count;
+static uint32_t zeropool_target;
+
+/*
+ * The shared zero page. Read faults on anonymous memory that has never
+ * been written map it read-only instead of taking a frame; the first
+ * write gets a private page (see vm_fault). It is FIXED, so it is never
+ * evicted or freed and its refcount is not kept.
+ */
+static struct page *zero_page;
+
+/*
+ * The page cache: frames holding file pages for mmap, on hash chains
+ * keyed by (vnode, offset) and linked through next_cached. Protected
+ * by coremap_lock like the rest of the coremap. A page stays cached
+ * after its last mapping goes, until it is evicted or its vnode is
+ * reclaimed, so mapping a file again while it is in use is cheap.
+ */
+#define PCACHE_BUCKETS 128
+static struct page *pcache_table[PCACHE_BUCKETS];
+static uint32_t pcache_count;
+
+/*
+ * Executables kept by pagecache_keep, most recently run first. Each
+ * holds a vnode reference, so that the text of a program that is run
+ * over and over stays cached between runs instead of being purged
+ * when its last process exits.
+ */
+#define PCACHE_KEEP 8
+static struct spinlock pcache_keep_lock = SPINLOCK_INITIALIZER;
+static struct vnode *pcache_kept[PCACHE_KEEP];
+
+/*
+ * Pages evicted together. Their shootdowns have to fit in one CPU's
+ * queue (TLBSHOOTDOWN_MAX), since evict_lock keeps it to one batch in
+ * flight at a time.
+ */
+#define EVICT_BATCH 8
+
+/*
+ * Address space IDs. ASIDs 1 to NUM_ASID-1 are handed out in order;
+ * when they run out a new generation starts, and each CPU flushes its
+ * TLB before it next loads an ASID, since the numbers are being reused.
+ * ASID 0 is never handed out. With asids_enabled clear every switch
+ * flushes the TLB anyway, as if there were no ASIDs.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
+static bool asids_enabled = true;
+
+/*
+ * Event counters, one set per CPU (CPUs past VMSTAT_MAXCPUS share).
+ * They are only bumped with coremap_lock held, which also keeps the
+ * CPU from switching threads halfway through; vm_getstats adds them
+ * up. The page counts in struct vmstats are taken from the coremap
+ * when asked for instead.
+ */
+#define VMSTAT_MAXCPUS 32
+static struct vmstats vm_cpustats[VMSTAT_MAXCPUS];
+
+#define VMSTAT_INC(field) \
+	(vm_cpustats[curcpu->c_number % VMSTAT_MAXCPUS].field++)
+
+/*
+ * Fault-around and sequential prefetch (see vm_fault). A fault also
+ * loads TLB entries for the resident pages in the aligned window of
+ * faultaround pages around it (1 turns this off). Once PREFETCH_RUN
+ * faults in a row have hit consecutive pages, each fault also brings
+ * in the next prefetch pages that are in swap or in a file, as long as
+ * PREFETCH_RESERVE free pages are left. Protected by coremap_lock.
+ */
+#define FAULTAROUND_MAX 16
+#define PREFETCH_MAX 16
+#define PREFETCH_RUN 2
+#define PREFETCH_RESERVE 32
+static unsigned faultaround = 8;
+static unsigned prefetch = 4;
+
+static
+void
+freelist_add(struct page *block, int32_t order)
+{
+	block->order = order;
+	block->prev_free = NULL;
+	block->next_free = freeblocks[order];
+	if(freeblocks[order] != NULL)
+		freeblocks[order]->prev_free = block;
+	freeblocks[order] = block;
+}
+
+static
+void
+freelist_remove(struct page *block)
+{
+	if(block->prev_free != NULL)
+		block->prev_free->next_free = block->next_free;
+	else
+		freeblocks[block->order] = block->next_free;
+	if(block->next_free != NULL)
+		block->next_free->prev_free = block->prev_free;
+	block->order = PAGE_NOORDER;
+	block->next_free = NULL;
+	block->prev_free = NULL;
+}
+
+/**
+ * Return a free block of 2^order pages, splitting a larger block if
+ * needed. Caller must hold coremap_lock.
+ */
+static
+struct page *
+buddy_alloc(int32_t order)
+{
+	int32_t k;
+	struct page *block;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for(k = order; k <= PAGE_MAXORDER; k++)
+	{
+		if(freeblocks[k] != NULL)
+			break;
+	}
+	if(k > PAGE_MAXORDER)
+		return NULL;
+
+	block = freeblocks[k];
+	freelist_remove(block);
+
+	// Give back the upper halves until the block has the right size
+	while(k > order)
+	{
+		k--;
+		freelist_add(block + (1 << k), k);
+	}
+
+	coremap_nfree -= (1 << order);
+	return block;
+}
+
+/**
+ * Free the block of 2^order pages at coremap index idx, merging it with
+ * its buddy for as long as the buddy is free too. Caller must hold
+ * coremap_lock.
+ */
+static
+void
+buddy_free(uint32_t idx, int32_t order)
+{
+	uint32_t rel = idx - coremap_base;
+	uint32_t nmanaged = page_num - coremap_base;
+	uint32_t buddy;
+	struct page *p;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT((rel & ((1 << order) - 1)) == 0);
+
+	coremap_nfree += (1 << order);
+
+	for(uint32_t i = 0; i < ((uint32_t)1 << order); i++)
+	{
+		p = pages + idx + i;
+		p->addrspce = NULL;
+		p->user_vaddr = 0;
+		p->page_state = FREE;
+		p->num_pages = 1;
+		p->swap_slot = SWAP_NOSLOT;
+		p->referenced = false;
+		p->busy = false;
+		p->refcount = 0;
+		p->vnode = NULL;
+	}
+
+	// The buddy's pages are already FREE, so merging is O(1) per level
+	while(order < PAGE_MAXORDER)
+	{
+		buddy = rel ^ (1 << order);
+		if(buddy + (1 << order) > nmanaged)
+			break;
+		p = pages + coremap_base + buddy;
+		if(p->page_state != FREE || p->order != order)
+			break;
+		freelist_remove(p);
+		rel &= ~(uint32_t)(1 << order);
+		order++;
+	}
+
+	freelist_add(pages + coremap_base + rel, order);
+}
+
+/**
+ * Free npages pages starting at coremap index idx. The run need not be
+ * a power of two; it is split into the largest aligned blocks that fit.
+ */
+static
+void
+buddy_free_run(uint32_t idx, uint32_t npages)
+{
+	int32_t order;
+	uint32_t rel;
+
+	while(npages > 0)
+	{
+		rel = idx - coremap_base;
+		order = PAGE_MAXORDER;
+		while((rel & ((1 << order) - 1)) != 0 ||
+		      ((uint32_t)1 << order) > npages)
+			order--;
+		buddy_free(idx, order);
+		idx += (1 << order);
+		npages -= (1 << order);
+	}
+}
+
+/* Smallest order whose block holds npages pages */
+static
+int32_t
+npages_to_order(unsigned long npages)
+{
+	int32_t order = 0;
+
+	while(((unsigned long)1 << order) < npages)
+		order++;
+	return order;
+}
+
+/* Take a page from the zero pool, or NULL. Caller must hold coremap_lock. */
+static
+struct page *
+zeropool_get(void)
+{
+	struct page *p = zeropool;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if(p != NULL)
+	{
+		zeropool = p->next_free;
+		p->next_free = NULL;
+		zeropool_count--;
+	}
+	return p;
+}
+
+/**
+ * Give every pooled page back to the buddy allocator so that it can be
+ * merged into larger blocks again. Caller must hold coremap_lock.
+ */
+static
+void
+zeropool_drain(void)
+{
+	struct page *p;
+
+	while((p = zeropool_get()) != NULL)
+		buddy_free(p - pages, 0);
+}
 
 void
 vm_bootstrap(void)
@@ -62,8 +372,6 @@ vm_bootstrap(void)
 	paddr_t paddr_last = 0;
 	paddr_t paddr_free = 0;
 
-	lock_coremap = lock_create("coremap_lock");
-
 	/* Initialize coremap */
 	ram_getsize(&paddr_first, &paddr_last);
 
@@ -76,23 +384,61 @@ vm_bootstrap(void)
 
 	/* pages should be a kernel virtual address !!  */
 	pages = (struct page *) PADDR_TO_KVADDR(paddr_first);
+	coremap_paddr = paddr_first;
 	paddr_free = paddr_first + (page_num * CME_SIZE); // core map size
+	paddr_free = ROUNDUP(paddr_free, PAGE_SIZE);
 
 	// Mapping coremap elements(page table entry - PTE) to their respective virtual memory.
+	// Everything is FIXED until the buddy allocator takes it over below.
 	paddr_t tmp_addr = paddr_first;
 	for (uint32_t i = 0; i < page_num; i++)
 	{
+		(pages + i)-> addrspce = NULL;
+		(pages + i)-> user_vaddr = 0;
 		(pages + i)-> virtual_addr = PADDR_TO_KVADDR(tmp_addr);
 		(pages + i)-> num_pages = 1;
-		(pages + i)-> timestamp = 0;
-		if(tmp_addr < paddr_free)
-			(pages + i)-> page_state = FIXED;
-		else
-			(pages + i)-> page_state = FREE;
+		(pages + i)-> swap_slot = SWAP_NOSLOT;
+		(pages + i)-> referenced = false;
+		(pages + i)-> busy = false;
+		(pages + i)-> page_state = FIXED;
+		(pages + i)-> refcount = 0;
+		(pages + i)-> order = PAGE_NOORDER;
+		(pages + i)-> next_free = NULL;
+		(pages + i)-> prev_free = NULL;
+		(pages + i)-> kheap_tag = NULL;
+		(pages + i)-> vnode = NULL;
+		(pages + i)-> file_offset = 0;
+		(pages + i)-> next_cached = NULL;
+		(pages + i)-> writer = NULL;
 		tmp_addr += PAGE_SIZE;
 	}
-
-	KASSERT(lock_coremap != NULL);
+	coremap_base = (paddr_free - paddr_first) / PAGE_SIZE;
+
+	// Hand everything past the coremap itself to the buddy allocator
+	spinlock_acquire(&coremap_lock);
+	coremap_nfree = 0;
+	for (int32_t k = 0; k <= PAGE_MAXORDER; k++)
+		freeblocks[k] = NULL;
+	buddy_free_run(coremap_base, page_num - coremap_base);
+	zeropool = NULL;
+	zeropool_count = 0;
+	zeropool_target = (page_num - coremap_base) / 16;
+	if (zeropool_target > ZEROPOOL_MAX)
+		zeropool_target = ZEROPOOL_MAX;
+	zero_page = buddy_alloc(0);
+	KASSERT(zero_page != NULL);
+	zero_page->page_state = FIXED;
+	coremap_ready = true;
+	spinlock_release(&coremap_lock);
+
+	bzero((void *)zero_page->virtual_addr, PAGE_SIZE);
+
+	coremap_wchan = wchan_create("coremap");
+	evict_lock = lock_create("evict");
+	shootdown_sem = sem_create("shootdown", 0);
+	if (coremap_wchan == NULL || evict_lock == NULL || shootdown_sem == NULL)
+		panic("vm_bootstrap: out of memory\n");
+	clock_hand = 0;
 }
 
 /**
@@ -122,308 +468,1993 @@ alloc_kpages(int npages)
 {
 
 	vaddr_t alloc_mem = 0;
-	if(lock_coremap != NULL)
+	paddr_t paddr;
+	if(coremap_ready)
 		alloc_mem = page_nalloc(npages);
 	else
 	{
-		if(getppages(npages) != 0)
-			alloc_mem = PADDR_TO_KVADDR(getppages(npages));
+		paddr = getppages(npages);
+		if(paddr != 0)
+			alloc_mem = PADDR_TO_KVADDR(paddr);
 		else
 			panic("ERROR : Zero address returned.");
 	}
 	return alloc_mem;
 }
 
-void 
-free_kpages(vaddr_t addr)
+/**
+ * Coremap entry of the page at kernel virtual address addr, or NULL if
+ * the address is not in memory managed by the coremap (memory stolen
+ * before vm_bootstrap, for instance). O(1): the page frame number is
+ * the index into the coremap.
+ */
+static
+struct page *
+kvaddr_to_page(vaddr_t addr)
 {
-	//lock_acquire(lock_coremap);
+	paddr_t paddr;
+	uint32_t idx;
 
-	struct page *find_page = pages;
+	if(addr < MIPS_KSEG0 || addr >= MIPS_KSEG1)
+		return NULL;
 
-	uint32_t page_cnt = 0;
-	//while(find_page->virtual_addr != addr)
-	for(page_cnt=0;page_cnt < page_num;page_cnt++)
-	{
-		if(find_page->virtual_addr == addr)
-			break;
-		find_page ++;
-	}
+	paddr = KVADDR_TO_PADDR(addr);
+	if(paddr < coremap_paddr)
+		return NULL;
 
-	//Check whether this is the page we are looking for to de-allocate.
-	//KASSERT(find_page->virtual_addr == addr);
-	if(find_page->virtual_addr != addr)
-	{
-		//lock_release(lock_coremap);
-		return;
-	}
+	idx = (paddr - coremap_paddr) / PAGE_SIZE;
+	if(idx >= page_num)
+		return NULL;
 
+	return pages + idx;
+}
 
-	// if the address to be freed belongs to kernel then dont do anything
-	// else free it.
-	if(find_page->page_state != FIXED)
-	{
-		int no_dealloc = find_page->num_pages;
-		for (int i = 0; i < no_dealloc; ++i)
-		{
-			find_page->page_state =  FREE;
-			find_page->timestamp = 0;
-			find_page->num_pages = 1;
-			as_destroy(find_page->addrspce);
-			find_page ++;{
-				lock_release(lock_coremap);
-				return;
-			}
+/* Coremap entry of the user frame at paddr */
+static
+struct page *
+paddr_to_page(paddr_t paddr)
+{
+	struct page *p = kvaddr_to_page(PADDR_TO_KVADDR(paddr));
 
-		}
-	}
+	KASSERT(p != NULL);
+	return p;
+}
 
-	//lock_release(lock_coremap);
+/**
+ * Sleep until a busy page is let go. Called and returns with
+ * coremap_lock held, but the lock is dropped meanwhile, so the caller
+ * has to look again at whatever it was waiting for.
+ */
+static
+void
+page_wait(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
 
+	wchan_lock(coremap_wchan);
+	spinlock_release(&coremap_lock);
+	wchan_sleep(coremap_wchan);
+	spinlock_acquire(&coremap_lock);
 }
 
-
+/**
+ * Drop one reference to the run of pages headed by p; the last one
+ * frees the run along with its copy in swap, if any. A frame that is
+ * still shared may just have lost its recorded owner's reference, so
+ * it forgets its owner until the next fault on it. Caller must hold
+ * coremap_lock.
+ */
+static
 void
-page_free(vaddr_t addr)
+page_unref(struct page *p)
 {
-	//lock_acquire(lock_coremap);
-
-	struct page *find_page = pages;
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
 
-	uint32_t page_cnt = 0;
-	//while(find_page->virtual_addr != addr)
-	for(page_cnt=0;page_cnt < page_num;page_cnt++)
-	{
-		if(find_page->virtual_addr == addr)
-			break;
-		find_page ++;
-	}
+	// if the address to be freed belongs to kernel then dont do anything
+	if(p->page_state == FIXED || p->page_state == FREE)
+		return;
 
-	//Check whether this is the page we are looking for to de-allocate.
-	//KASSERT(find_page->virtual_addr == addr);
-	if(find_page->virtual_addr != addr)
+	if(p->refcount > 1)
 	{
-	//	lock_release(lock_coremap);
+		p->refcount--;
+		p->addrspce = NULL;
 		return;
 	}
 
-	// if the address to be freed belongs to kernel then dont do anything
-	// else free it.
-	if(find_page->page_state != FIXED)
-	{
-		int32_t no_dealloc = find_page->num_pages;
-		for (int32_t i = 0; i < no_dealloc; ++i)
-		{
-			find_page->page_state =  FREE;
-			find_page->timestamp = 0;
-			find_page->num_pages = 1;
-			//as_destroy(find_page->addrspce); user space ---??
+	if(p->swap_slot != SWAP_NOSLOT)
+		swap_free(p->swap_slot);
+	buddy_free_run(p - pages, p->num_pages);
+}
 
-			find_page ++;;
-		}
+/* Page table entries mapping p, leaving out the page cache's reference */
+static
+int32_t
+page_mappers(struct page *p)
+{
+	return p->vnode != NULL ? p->refcount - 1 : p->refcount;
+}
 
+static
+unsigned
+pcache_hash(struct vnode *vn, off_t offset)
+{
+	return (((uintptr_t)vn >> 4) + (uint32_t)(offset / PAGE_SIZE)) %
+		PCACHE_BUCKETS;
+}
+
+/* Cached page of vn at offset, or NULL. Caller must hold coremap_lock. */
+static
+struct page *
+pcache_find(struct vnode *vn, off_t offset)
+{
+	struct page *p;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for(p = pcache_table[pcache_hash(vn, offset)]; p != NULL;
+	    p = p->next_cached)
+	{
+		if(p->vnode == vn && p->file_offset == offset)
+			return p;
 	}
+	return NULL;
+}
+
+/* Put p in the page cache as vn's page at offset. Caller must hold coremap_lock. */
+static
+void
+pcache_insert(struct page *p, struct vnode *vn, off_t offset)
+{
+	unsigned h = pcache_hash(vn, offset);
 
-	//lock_release(lock_coremap);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
 
+	p->vnode = vn;
+	p->file_offset = offset;
+	p->next_cached = pcache_table[h];
+	pcache_table[h] = p;
+	pcache_count++;
 }
 
+/**
+ * Take p out of the page cache. Its refcount is left alone: the cache's
+ * reference passes to the caller. Caller must hold coremap_lock.
+ */
+static
+void
+pcache_remove(struct page *p)
+{
+	struct page **pp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for(pp = &pcache_table[pcache_hash(p->vnode, p->file_offset)];
+	    *pp != p; pp = &(*pp)->next_cached)
+		KASSERT(*pp != NULL);
+	*pp = p->next_cached;
+	p->next_cached = NULL;
+	p->vnode = NULL;
+	p->file_offset = 0;
+	pcache_count--;
+}
 
 /**
- * page_alloc - Page allocation for user program
+ * Free the run of pages that starts at addr. The run length was
+ * recorded in num_pages when the run was allocated, so this costs
+ * O(num_pages) no matter how big memory is.
  */
-vaddr_t
-page_alloc()
+static
+void
+page_run_free(vaddr_t addr)
 {
-	lock_acquire(lock_coremap);
-	/**
-	 * Find some free memory and try to allocate to the caller
-	 */
-	struct page *free_page = pages;
-	uint32_t i = 0;
-	//int32_t oldest_page_timestamp = 0xffffffff;
-	//int32_t oldest_page_num = -1;
-	for(i=0;i < page_num; i++)
-	{
-		// TODO : allocate the pages if its not fixed untill swapping is implemented
-		/*Logic for page swapping - FIFO*/
-		/*if(free_page -> timestamp < oldest_page_timestamp)
-		{
-			oldest_page_timestamp = free_page -> timestamp;
-			oldest_page_num = i;
-		}*/
-		if(free_page ->page_state == FREE) //if(free_page ->page_state != FIXED)
-			break;
-		free_page ++;
-	}
+	struct page *find_page;
 
-	//free_page = pages + (oldest_page_num * PTE_SIZE);
+	KASSERT((addr & ~PAGE_FRAME) == 0);
 
-	// The oldest page has to be made available and used
-	make_page_avail(free_page);
+	find_page = kvaddr_to_page(addr);
+	if(find_page == NULL)
+		return;
 
-	//free_page->addrspce = as_create();
-	free_page->num_pages = 1;
+	spinlock_acquire(&coremap_lock);
+	page_unref(find_page);
+	spinlock_release(&coremap_lock);
+}
 
-	time_t current_time = 0;
-	//gettime(&current_time, NULL);
-	if(current_time != -1)
-		free_page->timestamp = current_time;
-	else
-		return EFAULT;
+void
+free_kpages(vaddr_t addr)
+{
+	page_run_free(addr);
+}
 
-	bzero((void *)free_page->virtual_addr, PAGE_SIZE);
+void
+kpage_settag(vaddr_t addr, void *tag)
+{
+	struct page *p = kvaddr_to_page(addr);
 
-	make_page_avail(free_page);
+	if(p != NULL)
+		p->kheap_tag = tag;
+}
 
-	lock_release(lock_coremap);
+void *
+kpage_gettag(vaddr_t addr)
+{
+	struct page *p = kvaddr_to_page(addr);
 
-	return free_page->virtual_addr;
+	if(p == NULL)
+		return NULL;
+	return p->kheap_tag;
 }
 
-vaddr_t
-page_nalloc(unsigned long npages)
+
+void
+page_free(vaddr_t addr)
 {
-	lock_acquire(lock_coremap);
-	/**
-	 * Find some free memory and try to allocate to the caller
-	 */
-	struct page *free_page = pages;
+	page_run_free(addr);
+}
+
+
+/* Drop this CPU's translation for vaddr in as, if it has one */
+static
+void
+tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe((vaddr & PAGE_FRAME) | (as->asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0)
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	tlb_setasid(curcpu->c_asid);
+	splx(spl);
+}
+
+/**
+ * Remove every translation of the given user pages and wait until that
+ * is done. With ASIDs, a page can only be in the TLB of the CPU its
+ * address space last ran on (see vm_activate): pages of ours are
+ * invalidated here, each other CPU involved gets one IPI carrying all
+ * of its pages, and CPUs not involved are left alone. Caller must hold
+ * evict_lock, which makes shootdown_sem ours.
+ */
+static
+void
+tlbshootdown_pages(struct page **victims, unsigned n)
+{
+	struct tlbshootdown ts[EVICT_BATCH];
+	struct tlbshootdown batch[EVICT_BATCH];
+	struct cpu *cpus[EVICT_BATCH];
+	struct cpu *target;
+	unsigned i, j, nbatch, nsent = 0;
+	int spl;
+
+	KASSERT(lock_do_i_hold(evict_lock));
+	KASSERT(n <= EVICT_BATCH);
 
-	uint32_t start_page = 0;
-	uint32_t free_page_cnt = 0;
-	for(start_page=0;start_page < page_num;start_page++)
+	// Stay on this CPU while deciding what is local
+	spl = splhigh();
+
+	for(i = 0; i < n; i++)
 	{
-		if(free_page->page_state == FREE)
-		{
-			for (free_page_cnt=1; free_page_cnt<npages; free_page_cnt++)
-			{
-				free_page ++;
-				if(free_page->page_state != FREE)
-					break;
-			}
+		ts[i].ts_addrspace = victims[i]->addrspce;
+		ts[i].ts_vaddr = victims[i]->user_vaddr;
+		ts[i].ts_done = shootdown_sem;
 
-			if(free_page_cnt == npages)
-				break;
-			else
-				start_page += free_page_cnt - 1;
+		spinlock_acquire(&asid_lock);
+		cpus[i] = ts[i].ts_addrspace->asid_cpu;
+		spinlock_release(&asid_lock);
+
+		if(cpus[i] == curcpu->c_self)
+		{
+			tlb_invalidate(ts[i].ts_addrspace, ts[i].ts_vaddr);
+			cpus[i] = NULL;
 		}
-		free_page ++;
 	}
 
-	// what if there is no free  page?
-	// Follow page replacement algorithm
-	// As of now we take a random NOT FIXED page and flush it
-
-	if(free_page_cnt  == 0)
+	for(i = 0; i < n; i++)
 	{
-		free_page = pages;
-		for(start_page=0;start_page < page_num;start_page++)
+		if(cpus[i] == NULL)
+			continue;
+		target = cpus[i];
+		nbatch = 0;
+		for(j = i; j < n; j++)
 		{
-			if(free_page->page_state != FIXED)
-				break;
-			free_page++;
+			if(cpus[j] == target)
+			{
+				batch[nbatch++] = ts[j];
+				cpus[j] = NULL;
+			}
 		}
-		free_page_cnt = npages;
+		ipi_tlbshootdown_batch(target, batch, nbatch);
+		nsent += nbatch;
 	}
 
-	// Check at the end of the iteration whether we got the
-	// number of pages we want
-	KASSERT(free_page_cnt == npages);
+	splx(spl);
 
-	free_page = pages + start_page;
-
-	// Make the entire page available
+	while(nsent-- > 0)
+		P(shootdown_sem);
+}
 
-	for (free_page_cnt=0; free_page_cnt<npages; free_page_cnt++)
+/* Could page p be evicted right now? Caller must hold coremap_lock. */
+static
+bool
+page_evictable(struct page *p)
+{
+	if(p->page_state != DIRTY && p->page_state != CLEAN)
+		return false;
+	// Dirty file pages are left to msync, munmap and sync: writing one
+	// back takes the file system's lock, which whoever needs the frame
+	// may be holding. A clean one goes if nothing maps it, or its one
+	// mapping is known.
+	if(p->vnode != NULL)
 	{
-		make_page_avail(free_page);
-
-		//free_page->addrspce = as_create();
-		free_page->num_pages = npages;
-
-		time_t current_time = 0;
-		//gettime(&current_time, NULL);
-		if(current_time != -1)
-			free_page->timestamp = current_time;
-		else
-			return EFAULT;
-
-		// Zeroing the page before returning
-		bzero((void *)free_page->virtual_addr, PAGE_SIZE);
-
-		free_page ++;
-
+		if(p->page_state != CLEAN || p->busy)
+			return false;
+		return page_mappers(p) == 0 ||
+			(page_mappers(p) == 1 && p->addrspce != NULL);
 	}
-	lock_release(lock_coremap);
-
-	// Start of n chunks of free pages
-	free_page = pages + start_page;
-	return free_page->virtual_addr;
-
+	// Anonymous pages have nowhere to go without swap
+	if(!swap_enabled())
+		return false;
+	// Kernel pages, pages whose owner is unknown and frames shared
+	// copy-on-write have no single PTE that could be updated
+	if(p->addrspce == NULL || p->refcount != 1)
+		return false;
+	return !p->busy;
 }
 
-
 /**
- * This function will make the page available for either by evicting the page to disk
- * a.k.a swapping out or by flushing it
- * Author : Babu
+ * Clock (second chance) page replacement, using the referenced bit
+ * vm_fault sets and the dirty state. Going round from where the hand
+ * last stopped, passes alternate between looking for a page that is
+ * neither referenced nor dirty, and so needs no disk write, and
+ * taking any unreferenced page while clearing the referenced bits it
+ * passes. Two rounds of each find a page if there is one to find.
+ * Caller must hold coremap_lock.
  */
-int32_t
-make_page_avail(struct page *free_page)
+static
+struct page *
+clock_select(void)
 {
+	uint32_t nmanaged = page_num - coremap_base;
+	struct page *p;
+	int pass;
 
-	// as of now just making the page state as free by flushing it
-	// TODO : implement swapping in thisas_create function
-
-	// Allocating it as dirty for the first time as the disk will not have a copy
-	free_page->page_state = DIRTY;
-	bzero((void *)free_page->virtual_addr, PAGE_SIZE);
-
-	return 0;
-}
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
 
+	for(pass = 0; pass < 4; pass++)
+	{
+		for(uint32_t i = 0; i < nmanaged; i++)
+		{
+			p = pages + coremap_base + clock_hand;
+			clock_hand = (clock_hand + 1) % nmanaged;
+
+			if(!page_evictable(p))
+				continue;
+			if(!p->referenced &&
+			   (p->page_state == CLEAN || pass % 2 == 1))
+				return p;
+			if(pass % 2 == 1)
+			{
+				p->referenced = false;
+				// Make its next use fault so the bit gets set again
+				if(p->addrspce == curthread->t_addrspace)
+					tlb_invalidate(p->addrspce, p->user_vaddr);
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Page out a user page and hand its frame to the caller, marked busy
+ * and with no owner. Dirty pages are written to a new swap slot; clean
+ * ones already have a copy there, and clean file pages are in their
+ * file, so they are just dropped from the page cache. Up to EVICT_BATCH pages go at once,
+ * so that their shootdowns share IPIs and the next few allocations find
+ * free frames; the extra frames are freed. Returns NULL if there is
+ * nothing to evict or nowhere to put it, or if we are somewhere we
+ * cannot sleep.
+ */
+static
+struct page *
+page_evict(void)
+{
+	struct page *victims[EVICT_BATCH];
+	struct page *mapped[EVICT_BATCH];
+	uint32_t slots[EVICT_BATCH];
+	int results[EVICT_BATCH];
+	struct page *victim, *mine;
+	unsigned nvictims, nmapped, i;
+	pte_t *pte;
+
+	if(curthread->t_in_interrupt || curthread->t_iplhigh_count > 0)
+		return NULL;
+	// Swap I/O may allocate memory; it has to do without
+	if(lock_do_i_hold(evict_lock))
+		return NULL;
+
+	lock_acquire(evict_lock);
+
+	spinlock_acquire(&coremap_lock);
+	for(nvictims = 0; nvictims < EVICT_BATCH; nvictims++)
+	{
+		victim = clock_select();
+		if(victim == NULL)
+			break;
+		victim->busy = true;
+		// A cached page nothing maps only has the cache to leave
+		if(victim->vnode != NULL && page_mappers(victim) == 0)
+			pcache_remove(victim);
+		victims[nvictims] = victim;
+	}
+	spinlock_release(&coremap_lock);
+
+	if(nvictims == 0)
+	{
+		lock_release(evict_lock);
+		return NULL;
+	}
+
+	// Once no TLB maps them, the pages can neither change nor be
+	// mapped again (vm_fault waits while they are busy)
+	nmapped = 0;
+	for(i = 0; i < nvictims; i++)
+	{
+		if(victims[i]->addrspce != NULL)
+			mapped[nmapped++] = victims[i];
+	}
+	tlbshootdown_pages(mapped, nmapped);
+
+	for(i = 0; i < nvictims; i++)
+	{
+		victim = victims[i];
+		if(victim->page_state != DIRTY)
+		{
+			slots[i] = victim->swap_slot;
+			results[i] = 0;
+			continue;
+		}
+		results[i] = swap_alloc(&slots[i]);
+		if(results[i] == 0)
+		{
+			results[i] = swap_out(slots[i],
+					      KVADDR_TO_PADDR(victim->virtual_addr));
+			if(results[i])
+				swap_free(slots[i]);
+		}
+	}
+
+	// The slot reference passes from each frame to its PTE. The first
+	// frame is the caller's; the rest go back to the free lists.
+	mine = NULL;
+	spinlock_acquire(&coremap_lock);
+	for(i = 0; i < nvictims; i++)
+	{
+		victim = victims[i];
+		if(results[i])
+		{
+			// Could not be written out; leave it where it is
+			victim->busy = false;
+			continue;
+		}
+
+		if(victim->addrspce != NULL)
+		{
+			pte = pt_lookup(victim->addrspce->table,
+					victim->user_vaddr, false);
+			KASSERT(pte != NULL);
+			KASSERT((*pte & PTE_FRAME) ==
+				KVADDR_TO_PADDR(victim->virtual_addr));
+			if(victim->vnode != NULL)
+			{
+				// The next fault gets it through the cache again
+				*pte = 0;
+				pcache_remove(victim);
+				victim->refcount--;
+			}
+			else
+				*pte = PTE_MKSWAP(slots[i]);
+		}
+
+		VMSTAT_INC(vs_evictions);
+		if(victim->page_state == DIRTY)
+			VMSTAT_INC(vs_swapouts);
+		victim->addrspce = NULL;
+		victim->user_vaddr = 0;
+		victim->page_state = DIRTY;
+		victim->swap_slot = SWAP_NOSLOT;
+		victim->referenced = false;
+		if(mine == NULL)
+			mine = victim;
+		else
+			buddy_free_run(victim - pages, 1);
+	}
+	wchan_wakeall(coremap_wchan);
+	spinlock_release(&coremap_lock);
+
+	lock_release(evict_lock);
+	return mine;
+}
+
+/**
+ * Take one frame for a user page, evicting another page if memory is
+ * full. The frame comes back busy, so nothing can evict it before the
+ * caller has mapped it and cleared busy. It is zero-filled if zero is
+ * set, else its contents are garbage.
+ */
+static
+struct page *
+frame_alloc(bool zero)
+{
+	struct page *p = NULL;
+	bool zeroed;
+
+	spinlock_acquire(&coremap_lock);
+	// Whoever wants zeroes tries the pool first; anybody may fall back
+	// on it once the buddy allocator is empty
+	if(zero)
+		p = zeropool_get();
+	if(p == NULL)
+		p = buddy_alloc(0);
+	if(p == NULL)
+		p = zeropool_get();
+	zeroed = (p != NULL && p->page_state == ZEROED);
+	if(p != NULL)
+	{
+		p->page_state = DIRTY;
+		p->num_pages = 1;
+		p->refcount = 1;
+		p->busy = true;
+	}
+	spinlock_release(&coremap_lock);
+
+	if(p == NULL)
+		p = page_evict();
+	if(p != NULL && zero && !zeroed)
+		bzero((void *)p->virtual_addr, PAGE_SIZE);
+	return p;
+}
+
+/**
+ * Read a cached page in from its file, or write it out. Only the part
+ * of the page inside the file is transferred; reading zeroes the rest.
+ * The page is busy, so neither its contents nor its place in the cache
+ * change meanwhile.
+ */
+static
+int
+pcache_io(struct page *p, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	size_t len = 0;
+	int result;
+
+	KASSERT(p->busy);
+
+	result = VOP_STAT(p->vnode, &st);
+	if(result)
+		return result;
+
+	if(st.st_size > p->file_offset)
+	{
+		len = PAGE_SIZE;
+		if(st.st_size - p->file_offset < PAGE_SIZE)
+			len = st.st_size - p->file_offset;
+	}
+
+	if(len > 0)
+	{
+		uio_kinit(&iov, &ku, (void *)p->virtual_addr, len,
+			  p->file_offset, rw);
+		if(rw == UIO_READ)
+			result = VOP_READ(p->vnode, &ku);
+		else
+			result = VOP_WRITE(p->vnode, &ku);
+		if(result)
+			return result;
+		if(rw == UIO_WRITE && ku.uio_resid != 0)
+			return EIO;
+		len -= ku.uio_resid;
+	}
+
+	if(rw == UIO_READ)
+		bzero((char *)p->virtual_addr + len, PAGE_SIZE - len);
+	return 0;
+}
+
+/**
+ * Find the page of vn at offset in the page cache, reading it in if it
+ * is not there, and take a reference to it for a new mapping. Called
+ * with coremap_lock held and returns with it held, but drops it to
+ * allocate and read. A page being read is in the cache already, busy,
+ * so whoever else wants it waits for it instead of reading it again.
+ */
+static
+int
+pcache_get(struct vnode *vn, off_t offset, struct page **ret)
+{
+	struct page *p, *new = NULL;
+	int result;
+
+	for(;;)
+	{
+		p = pcache_find(vn, offset);
+		if(p != NULL && p->busy)
+		{
+			page_wait();
+			continue;
+		}
+		if(p != NULL)
+		{
+			// Somebody read it in while we allocated
+			if(new != NULL)
+				page_unref(new);
+			else
+				VMSTAT_INC(vs_pcache_hits);
+			p->refcount++;
+			*ret = p;
+			return 0;
+		}
+		if(new != NULL)
+			break;
+
+		spinlock_release(&coremap_lock);
+		new = frame_alloc(false);
+		spinlock_acquire(&coremap_lock);
+		if(new == NULL)
+			return ENOMEM;
+	}
+
+	// One reference for the cache and one for the caller
+	VMSTAT_INC(vs_pcache_misses);
+	new->refcount = 2;
+	new->page_state = CLEAN;
+	pcache_insert(new, vn, offset);
+	spinlock_release(&coremap_lock);
+
+	result = pcache_io(new, UIO_READ);
+
+	spinlock_acquire(&coremap_lock);
+	if(result)
+	{
+		pcache_remove(new);
+		new->refcount = 1;
+		page_unref(new);
+	}
+	else
+	{
+		new->busy = false;
+		*ret = new;
+	}
+	wchan_wakeall(coremap_wchan);
+	return result;
+}
+
+/**
+ * Write a dirty cached page back to its file. It becomes CLEAN if no
+ * write to it can go unseen: if nothing maps it, or its one mapping is
+ * known and is shot down from the TLBs first, so that the next write
+ * faults and makes it DIRTY again. A page mapped more than once is
+ * written but stays DIRTY. Called with coremap_lock held and returns
+ * with it held, but drops it for the I/O. The page is busy meanwhile,
+ * so it cannot be unmapped, evicted or dropped, and whoever maps it
+ * keeps its vnode alive.
+ */
+static
+int
+pcache_writeback(struct page *p)
+{
+	int32_t mappers;
+	bool clean;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(p->vnode != NULL && p->page_state == DIRTY && !p->busy);
+
+	mappers = page_mappers(p);
+	clean = mappers == 0 || (mappers == 1 && p->addrspce != NULL);
+	p->busy = true;
+	p->writer = curthread;
+	if(clean)
+		p->page_state = CLEAN;
+	spinlock_release(&coremap_lock);
+
+	if(clean && mappers == 1)
+	{
+		lock_acquire(evict_lock);
+		tlbshootdown_pages(&p, 1);
+		lock_release(evict_lock);
+	}
+
+	result = pcache_io(p, UIO_WRITE);
+
+	spinlock_acquire(&coremap_lock);
+	if(result)
+		p->page_state = DIRTY;
+	p->writer = NULL;
+	p->busy = false;
+	wchan_wakeall(coremap_wchan);
+	return result;
+}
+
+int
+pagecache_writeback(struct vnode *vn, off_t offset)
+{
+	struct page *p;
+	int result = 0;
+
+	spinlock_acquire(&coremap_lock);
+	for(;;)
+	{
+		p = pcache_find(vn, offset);
+		if(p == NULL || !p->busy)
+			break;
+		page_wait();
+	}
+	if(p != NULL && p->page_state == DIRTY)
+		result = pcache_writeback(p);
+	spinlock_release(&coremap_lock);
+
+	return result;
+}
+
+/*
+ * A page stays in its chain across pcache_writeback, since it is busy
+ * until we have the lock back, so the walk can go on from it. Pages
+ * nothing maps are skipped: their vnode may be being reclaimed, and
+ * pagecache_purge writes them back then.
+ */
+int
+pagecache_sync(void)
+{
+	struct page *p;
+	unsigned i;
+	int result, err = 0;
+
+	spinlock_acquire(&coremap_lock);
+	for(i = 0; i < PCACHE_BUCKETS; i++)
+	{
+		for(p = pcache_table[i]; p != NULL; p = p->next_cached)
+		{
+			if(p->page_state != DIRTY || p->busy ||
+			   page_mappers(p) == 0)
+				continue;
+			result = pcache_writeback(p);
+			if(result && err == 0)
+				err = result;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	return err;
+}
+
+void
+pagecache_keep(struct vnode *vn)
+{
+	struct vnode *old;
+	unsigned i;
+
+	VOP_INCREF(vn);
+
+	spinlock_acquire(&pcache_keep_lock);
+	// Move vn to the front; whatever was in its slot, or the oldest
+	// one if it was not kept yet, comes out
+	for(i = 0; i < PCACHE_KEEP - 1 && pcache_kept[i] != vn; i++)
+		;
+	old = pcache_kept[i];
+	memmove(&pcache_kept[1], &pcache_kept[0], i * sizeof(pcache_kept[0]));
+	pcache_kept[0] = vn;
+	spinlock_release(&pcache_keep_lock);
+
+	// If it was vn itself, that drops the reference just taken
+	if(old != NULL)
+		VOP_DECREF(old);
+}
+
+void
+pagecache_unkeep(struct vnode *vn)
+{
+	bool kept = false;
+	unsigned i;
+
+	spinlock_acquire(&pcache_keep_lock);
+	for(i = 0; i < PCACHE_KEEP && pcache_kept[i] != vn; i++)
+		;
+	if(i < PCACHE_KEEP)
+	{
+		memmove(&pcache_kept[i], &pcache_kept[i + 1],
+			(PCACHE_KEEP - 1 - i) * sizeof(pcache_kept[0]));
+		pcache_kept[PCACHE_KEEP - 1] = NULL;
+		kept = true;
+	}
+	spinlock_release(&pcache_keep_lock);
+
+	if(kept)
+		VOP_DECREF(vn);
+}
+
+void
+pagecache_forget(void)
+{
+	struct vnode *kept[PCACHE_KEEP];
+	unsigned i;
+
+	spinlock_acquire(&pcache_keep_lock);
+	memcpy(kept, pcache_kept, sizeof(kept));
+	bzero(pcache_kept, sizeof(pcache_kept));
+	spinlock_release(&pcache_keep_lock);
+
+	for(i = 0; i < PCACHE_KEEP; i++)
+	{
+		if(kept[i] != NULL)
+			VOP_DECREF(kept[i]);
+	}
+}
+
+void
+pagecache_purge(struct vnode *vn)
+{
+	struct page *p, *next;
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	for(i = 0; i < PCACHE_BUCKETS && pcache_count > 0; i++)
+	{
+		p = pcache_table[i];
+		while(p != NULL)
+		{
+			if(p->vnode != vn)
+			{
+				p = p->next_cached;
+				continue;
+			}
+			if(p->busy)
+			{
+				page_wait();
+				p = pcache_table[i];
+				continue;
+			}
+			KASSERT(page_mappers(p) == 0);
+			// Last chance for the file to get it; if it fails
+			// there is nobody left to tell
+			if(p->page_state == DIRTY)
+				(void)pcache_writeback(p);
+			next = p->next_cached;
+			pcache_remove(p);
+			page_unref(p);
+			p = next;
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/**
+ * Bring the part of cached page p between start and end up to date
+ * with its file, which has just been written there. If nothing maps
+ * p and it holds nothing newer than the file it is simply dropped;
+ * otherwise that part is read again, so mappings see the write and
+ * dirty bytes outside it are kept. Called with coremap_lock held and
+ * returns with it held, but drops it for the read; p may be gone by
+ * then.
+ */
+static
+void
+pcache_refresh(struct page *p, off_t start, off_t end)
+{
+	struct iovec iov;
+	struct uio ku;
+	size_t skip, len;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(p->vnode != NULL && !p->busy);
+
+	if(start < p->file_offset)
+		start = p->file_offset;
+	if(end > p->file_offset + PAGE_SIZE)
+		end = p->file_offset + PAGE_SIZE;
+	skip = start - p->file_offset;
+	len = end - start;
+
+	if(page_mappers(p) == 0 &&
+	   (p->page_state == CLEAN || len == PAGE_SIZE))
+	{
+		pcache_remove(p);
+		page_unref(p);
+		return;
+	}
+
+	p->busy = true;
+	spinlock_release(&coremap_lock);
+
+	uio_kinit(&iov, &ku, (char *)p->virtual_addr + skip, len, start,
+		  UIO_READ);
+	result = VOP_READ(p->vnode, &ku);
+	if(!result)
+		bzero((char *)p->virtual_addr + skip + len - ku.uio_resid,
+		      ku.uio_resid);
+
+	spinlock_acquire(&coremap_lock);
+	p->busy = false;
+	// A mapped page that could not be read keeps what it had; there
+	// is nobody to tell
+	if(result && page_mappers(p) == 0)
+	{
+		pcache_remove(p);
+		page_unref(p);
+	}
+	wchan_wakeall(coremap_wchan);
+}
+
+/*
+ * The pages are looked up one by one rather than by walking the whole
+ * table, since most writes cover a page or two. A page pcache_writeback
+ * is writing is the source of this very write and is left alone;
+ * waiting for it would wait for ourselves.
+ */
+void
+pagecache_invalidate(struct vnode *vn, off_t offset, off_t len)
+{
+	struct page *p;
+	off_t pos, end = offset + len;
+
+	pagecache_unkeep(vn);
+	if(len <= 0)
+		return;
+
+	spinlock_acquire(&coremap_lock);
+	for(pos = offset - offset % PAGE_SIZE;
+	    pos < end && pcache_count > 0; pos += PAGE_SIZE)
+	{
+		for(;;)
+		{
+			p = pcache_find(vn, pos);
+			if(p == NULL || !p->busy || p->writer == curthread)
+				break;
+			page_wait();
+		}
+		if(p != NULL && !p->busy)
+			pcache_refresh(p, offset, end);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Pages wholly past the new end of file are dropped unless something
+ * maps them; the rest have the part past it zeroed, as a read of them
+ * from the file would. Nothing needs reading, so the lock is only
+ * dropped to wait for busy pages.
+ */
+void
+pagecache_truncate(struct vnode *vn, off_t len)
+{
+	struct page *p, *next;
+	size_t skip;
+	unsigned i;
+
+	pagecache_unkeep(vn);
+
+	spinlock_acquire(&coremap_lock);
+	for(i = 0; i < PCACHE_BUCKETS && pcache_count > 0; i++)
+	{
+		p = pcache_table[i];
+		while(p != NULL)
+		{
+			if(p->vnode != vn || p->file_offset + PAGE_SIZE <= len)
+			{
+				p = p->next_cached;
+				continue;
+			}
+			if(p->busy)
+			{
+				page_wait();
+				p = pcache_table[i];
+				continue;
+			}
+			next = p->next_cached;
+			if(p->file_offset >= len && page_mappers(p) == 0)
+			{
+				pcache_remove(p);
+				page_unref(p);
+			}
+			else
+			{
+				skip = p->file_offset >= len ? 0 :
+					len - p->file_offset;
+				bzero((char *)p->virtual_addr + skip,
+				      PAGE_SIZE - skip);
+			}
+			p = next;
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * How much of the page at vaddr of reg is in its file: all of it in a
+ * file mapping, part of it where a program segment's file part ends,
+ * and none of it in the zero-filled rest of the segment or if the
+ * region has no file.
+ */
+static
+size_t
+region_filebytes(struct region *reg, vaddr_t vaddr)
+{
+	size_t off;
+
+	if (reg == NULL || reg->vn == NULL)
+		return 0;
+	off = vaddr - reg->viraddress;
+	if (off >= reg->filesize)
+		return 0;
+	return reg->filesize - off < PAGE_SIZE ? reg->filesize - off : PAGE_SIZE;
+}
+
+/**
+ * Map the page of a file mapping at vaddr from the page cache. Called
+ * with coremap_lock held and returns with it held, but drops it (see
+ * pcache_get). The PTE maps nothing until then, and only the address
+ * space's own thread changes such a PTE.
+ */
+static
+int
+page_mapfile(struct region *reg, vaddr_t vaddr, pte_t *pte)
+{
+	struct page *p;
+	int result;
+
+	result = pcache_get(reg->vn, reg->offset + (vaddr - reg->viraddress),
+			   &p);
+	if (result)
+		return result;
+
+	KASSERT(*pte == 0);
+	*pte = (KVADDR_TO_PADDR(p->virtual_addr) & PTE_FRAME) | PTE_VALID;
+	return 0;
+}
+
+/**
+ * Give the page where a program segment's part in the file ends a
+ * frame of its own: its first amount bytes are copied from the cached
+ * file page, and the rest, which is the start of the segment's
+ * zero-filled part, is zeroed. Called with coremap_lock held and
+ * returns with it held, but drops it (see pcache_get); our reference
+ * keeps the cached page from being evicted meanwhile.
+ */
+static
+int
+page_fillpart(struct addrspace *as, struct region *reg, vaddr_t vaddr,
+	      pte_t *pte, size_t amount)
+{
+	struct page *cached, *p;
+	int result;
+
+	result = pcache_get(reg->vn, reg->offset + (vaddr - reg->viraddress),
+			   &cached);
+	if (result)
+		return result;
+	spinlock_release(&coremap_lock);
+
+	p = frame_alloc(false);
+	if (p != NULL)
+	{
+		memmove((void *)p->virtual_addr,
+			(const void *)cached->virtual_addr, amount);
+		bzero((char *)p->virtual_addr + amount, PAGE_SIZE - amount);
+	}
+
+	spinlock_acquire(&coremap_lock);
+	page_unref(cached);
+	if (p == NULL)
+		return ENOMEM;
+
+	KASSERT(*pte == 0);
+	*pte = (KVADDR_TO_PADDR(p->virtual_addr) & PTE_FRAME) | PTE_VALID;
+	p->addrspce = as;
+	p->user_vaddr = vaddr;
+	p->busy = false;
+	return 0;
+}
+
+/**
+ * Give a page that is not resident, or only maps the zero page, a frame
+ * of its own: read it back from swap if it was evicted, otherwise zero
+ * it. Called with coremap_lock held and returns with it held, but drops
+ * it to allocate and do I/O. Only the address space's own thread changes
+ * a PTE that maps no frame or the zero page, so the PTE stays put
+ * meanwhile.
+ */
+static
+int
+page_fill(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	pte_t old = *pte;
+	struct page *p;
+	int result;
+
+	spinlock_release(&coremap_lock);
+
+	p = frame_alloc(!(old & PTE_SWAPPED));
+	if (p == NULL)
+	{
+		spinlock_acquire(&coremap_lock);
+		return ENOMEM;
+	}
+
+	if (old & PTE_SWAPPED)
+	{
+		result = swap_in(PTE_SLOT(old), KVADDR_TO_PADDR(p->virtual_addr));
+		if (result)
+		{
+			spinlock_acquire(&coremap_lock);
+			page_unref(p);
+			return result;
+		}
+	}
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(*pte == old);
+	*pte = (KVADDR_TO_PADDR(p->virtual_addr) & PTE_FRAME) | PTE_VALID;
+	p->addrspce = as;
+	p->user_vaddr = vaddr;
+	if (old & PTE_SWAPPED)
+	{
+		// The PTE's reference to the slot passes to the frame
+		p->swap_slot = PTE_SLOT(old);
+		p->page_state = CLEAN;
+		VMSTAT_INC(vs_swapins);
+	}
+	else
+		VMSTAT_INC(vs_zerofills);
+	p->busy = false;
+	return 0;
+}
+
+/**
+ * Break copy-on-write sharing of the frame pte maps: give the page a
+ * private copy and drop our reference to the shared frame. Called with
+ * coremap_lock held and returns with it held, but drops it to allocate
+ * and copy; the shared frame stays busy meanwhile, so that it cannot
+ * be evicted under us if the other sharers let go of it.
+ */
+static
+int
+page_unshare(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	struct page *old, *new;
+
+	old = paddr_to_page(*pte & PTE_FRAME);
+	old->busy = true;
+	spinlock_release(&coremap_lock);
+
+	new = frame_alloc(false);
+	if (new != NULL)
+		memmove((void *)new->virtual_addr,
+			(const void *)old->virtual_addr, PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	old->busy = false;
+	if (new != NULL)
+	{
+		*pte = (KVADDR_TO_PADDR(new->virtual_addr) & PTE_FRAME) | PTE_VALID;
+		new->addrspce = as;
+		new->user_vaddr = vaddr;
+		new->busy = false;
+		page_unref(old);
+		VMSTAT_INC(vs_cowcopies);
+	}
+	wchan_wakeall(coremap_wchan);
+
+	return new == NULL ? ENOMEM : 0;
+}
+
+void
+pte_free(pte_t *pte)
+{
+	struct page *p;
+
+	spinlock_acquire(&coremap_lock);
+	while(*pte & PTE_VALID)
+	{
+		p = paddr_to_page(*pte & PTE_FRAME);
+		if(!p->busy)
+		{
+			page_unref(p);
+			break;
+		}
+		page_wait();
+	}
+	if(*pte & PTE_SWAPPED)
+		swap_free(PTE_SLOT(*pte));
+	*pte = 0;
+	spinlock_release(&coremap_lock);
+}
 
 void
-vm_tlbshootdown_all(void)
+pte_share(pte_t *oldpte, pte_t *newpte)
+{
+	struct page *p;
+
+	spinlock_acquire(&coremap_lock);
+	while(*oldpte & PTE_VALID)
+	{
+		p = paddr_to_page(*oldpte & PTE_FRAME);
+		if(!p->busy)
+		{
+			if(p != zero_page)
+				p->refcount++;
+			break;
+		}
+		page_wait();
+	}
+	if(*oldpte & PTE_SWAPPED)
+		swap_share(PTE_SLOT(*oldpte));
+	*newpte = *oldpte;
+	spinlock_release(&coremap_lock);
+}
+
+/**
+ * page_alloc - Page allocation for user program
+ * Returns a zeroed page that belongs to nobody. vm_fault itself uses
+ * frame_alloc, which keeps the page busy until it is mapped.
+ */
+vaddr_t
+page_alloc()
+{
+	struct page *free_page;
+
+	free_page = frame_alloc(true);
+	if(free_page == NULL)
+		return 0;
+
+	spinlock_acquire(&coremap_lock);
+	free_page->busy = false;
+	spinlock_release(&coremap_lock);
+
+	return free_page->virtual_addr;
+}
+
+vaddr_t
+page_nalloc(unsigned long npages)
+{
+	struct page *free_page = NULL;
+	int32_t order;
+	uint32_t start_page;
+	bool zeroed;
+
+	if(npages == 0)
+		return 0;
+
+	order = npages_to_order(npages);
+	if(order > PAGE_MAXORDER)
+		return 0;
+
+	spinlock_acquire(&coremap_lock);
+	if(npages == 1)
+		free_page = zeropool_get();
+	if(free_page == NULL)
+	{
+		free_page = buddy_alloc(order);
+		// Pooled pages may be what keeps a big enough block apart
+		if(free_page == NULL && zeropool_count > 0)
+		{
+			zeropool_drain();
+			free_page = buddy_alloc(order);
+		}
+	}
+	zeroed = (free_page != NULL && free_page->page_state == ZEROED);
+	if(free_page != NULL)
+	{
+		start_page = free_page - pages;
+
+		for(unsigned long i = 0; i < npages; i++)
+		{
+			free_page[i].page_state = DIRTY;
+			free_page[i].num_pages = npages;
+			free_page[i].refcount = 1;
+		}
+
+		// Give back the tail of the block that was not asked for
+		if(npages < ((unsigned long)1 << order))
+			buddy_free_run(start_page + npages, (1 << order) - npages);
+	}
+	spinlock_release(&coremap_lock);
+
+	// Out of memory: a single page can still be had by evicting one
+	if(free_page == NULL && npages == 1)
+	{
+		free_page = page_evict();
+		if(free_page != NULL)
+		{
+			spinlock_acquire(&coremap_lock);
+			free_page->busy = false;
+			spinlock_release(&coremap_lock);
+		}
+	}
+	if(free_page == NULL)
+		return 0;
+
+	// Zeroing the pages before returning, unless the pool did it
+	if(!zeroed)
+		bzero((void *)free_page->virtual_addr, npages * PAGE_SIZE);
+
+	// Start of n chunks of free pages
+	return free_page->virtual_addr;
+
+}
+
+/**
+ * Called by the idle loop when this CPU has nothing to run: zero one
+ * free page for the pool. Returns false if there was nothing to do, so
+ * the CPU can go to sleep instead.
+ */
+bool
+vm_zero_idle(void)
 {
-	lock_acquire(lock_coremap);
+	struct page *p;
+
+	if(!coremap_ready)
+		return false;
+
+	spinlock_acquire(&coremap_lock);
+	if(zeropool_count >= zeropool_target)
+	{
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	p = buddy_alloc(0);
+	if(p == NULL)
+	{
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	// Neither free nor evictable while we zero it
+	p->page_state = DIRTY;
+	spinlock_release(&coremap_lock);
 
-	/* TODO */
+	bzero((void *)p->virtual_addr, PAGE_SIZE);
 
-	lock_release(lock_coremap);
+	spinlock_acquire(&coremap_lock);
+	p->page_state = ZEROED;
+	p->next_free = zeropool;
+	zeropool = p;
+	zeropool_count++;
+	spinlock_release(&coremap_lock);
+
+	return true;
 }
 
 
+/**
+ * Invalidate every entry in this CPU's TLB.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++)
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	tlb_setasid(curcpu->c_asid);
 
+	splx(spl);
+}
+
+
+/**
+ * Invalidate one page on this CPU, and tell whoever asked.
+ */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	//lock_acquire(lock_coremap);
+	tlb_invalidate(ts->ts_addrspace, ts->ts_vaddr);
+	if (ts->ts_done != NULL)
+		V(ts->ts_done);
+}
+
+/*
+ * Whether the TLB entry for p may be writeable: the region allows
+ * writes and a write would not have to fault anyway, because the page
+ * is already dirty and ours alone, or a shared file page.
+ */
+static
+bool
+tlb_writeable(struct page *p, bool writeable, bool sharedwrite)
+{
+	return writeable && p->page_state == DIRTY &&
+		(p->refcount == 1 || (p->vnode != NULL && sharedwrite));
+}
+
+/*
+ * The pages around vaddr that share its permissions: its region, or the
+ * heap or the stack.
+ */
+static
+void
+fault_bounds(struct addrspace *as, struct region *reg, vaddr_t vaddr,
+	     vaddr_t *lo, vaddr_t *hi)
+{
+	if (reg != NULL)
+	{
+		*lo = reg->viraddress;
+		*hi = reg->viraddress + reg->numpages * PAGE_SIZE;
+	}
+	else if (vaddr >= as->hbase && vaddr < ROUNDUP(as->htop, PAGE_SIZE))
+	{
+		*lo = as->hbase;
+		*hi = ROUNDUP(as->htop, PAGE_SIZE);
+	}
+	else
+	{
+		*lo = as->sbase;
+		*hi = as->stop;
+	}
+}
+
+/**
+ * Load a TLB entry for a page next to a fault, if it is resident and
+ * nobody is paging it. Unlike the faulting page it is not marked
+ * referenced, so the clock only sees pages really used. A page that
+ * comes whole from reg's file and is not mapped yet is mapped if it is
+ * in the page cache. Returns true if the page is in the TLB. Caller
+ * must hold coremap_lock.
+ */
+static
+bool
+tlb_preload(struct addrspace *as, struct region *reg, vaddr_t vaddr,
+	    bool writeable, bool sharedwrite)
+{
+	struct page *p;
+	pte_t *pte;
+	uint32_t ehi, elo;
+	int spl;
+
+	/* Never allocates: the table would need kmalloc */
+	pte = pt_lookup(as->table, vaddr, false);
+	if (pte == NULL)
+		return false;
 
-	int i,spl;
+	if (*pte == 0 && region_filebytes(reg, vaddr) == PAGE_SIZE)
+	{
+		p = pcache_find(reg->vn,
+				reg->offset + (vaddr - reg->viraddress));
+		if (p == NULL || p->busy)
+			return false;
+		p->refcount++;
+		*pte = (KVADDR_TO_PADDR(p->virtual_addr) & PTE_FRAME) |
+			PTE_VALID;
+	}
+	if (!(*pte & PTE_VALID))
+		return false;
+	p = paddr_to_page(*pte & PTE_FRAME);
+	if (p->busy)
+		return false;
+	if (page_mappers(p) == 1 && p->addrspce == NULL)
+	{
+		p->addrspce = as;
+		p->user_vaddr = vaddr;
+	}
+
+	ehi = vaddr | (as->asid << TLBHI_PIDSHIFT);
+	elo = (*pte & PTE_FRAME) | TLBLO_VALID;
+	if (tlb_writeable(p, writeable, sharedwrite))
+		elo |= TLBLO_DIRTY;
+
+	spl = splhigh();
+	if (tlb_probe(ehi, 0) < 0)
+	{
+		tlb_random(ehi, elo);
+		VMSTAT_INC(vs_tlb_preloads);
+	}
+	splx(spl);
+	return true;
+}
 
-	    spl = splhigh();
+/**
+ * Fault-around: preload the TLB with the resident pages in the window
+ * around the faulting page. Returns the address just past the pages
+ * from the faulting one up that are now in the TLB. Caller must hold
+ * coremap_lock.
+ */
+static
+vaddr_t
+fault_around(struct addrspace *as, struct region *reg, vaddr_t vaddr,
+	     bool writeable, bool sharedwrite)
+{
+	vaddr_t lo, hi, start, va, next;
 
-	    for (i=0; i<NUM_TLB; i++)
-	        tlb_write(TLBHI_INVALID(i),TLBLO_INVALID(),i);
+	next = vaddr + PAGE_SIZE;
+	if (faultaround <= 1)
+		return next;
 
-	    splx(spl);
+	fault_bounds(as, reg, vaddr, &lo, &hi);
+	start = vaddr & ~(vaddr_t)(faultaround * PAGE_SIZE - 1);
+	if (start > lo)
+		lo = start;
+	if (start + faultaround * PAGE_SIZE < hi)
+		hi = start + faultaround * PAGE_SIZE;
 
-	//lock_release(lock_coremap);
-	(void)ts;
+	for (va = lo; va < hi; va += PAGE_SIZE)
+	{
+		if (va == vaddr)
+			continue;
+		if (tlb_preload(as, reg, va, writeable, sharedwrite) &&
+		    va == next)
+			next += PAGE_SIZE;
+	}
+	return next;
+}
 
+/**
+ * Sequential prefetch: bring in the pages from start up that are in
+ * swap, or in the file of a file mapping or program region, and load
+ * them into the TLB, so a linear walk does not fault on each one.
+ * Stops at the first page that cannot be had cheaply or when memory
+ * runs low, since it must not evict. Returns the address just past
+ * what it got. Called with coremap_lock held and returns with it held,
+ * but drops it (see page_fill, page_mapfile and page_fillpart).
+ */
+static
+vaddr_t
+prefetch_ahead(struct addrspace *as, struct region *reg, vaddr_t vaddr,
+	       vaddr_t start, bool writeable, bool sharedwrite)
+{
+	vaddr_t lo, hi, va;
+	pte_t *pte;
+	size_t filebytes;
+	bool fetch;
+	unsigned i;
+	int result;
+
+	/* Only as far as the faulting page's permissions go */
+	fault_bounds(as, reg, vaddr, &lo, &hi);
+
+	va = start;
+	for (i = 0; i < prefetch && va < hi; i++, va += PAGE_SIZE)
+	{
+		if (coremap_nfree + zeropool_count < PREFETCH_RESERVE)
+			break;
+		pte = pt_lookup(as->table, va, false);
+		if (pte == NULL)
+			break;
+		filebytes = region_filebytes(reg, va);
+		fetch = (*pte == 0 && filebytes > 0) || (*pte & PTE_SWAPPED);
+		if (*pte == 0 && filebytes == PAGE_SIZE)
+			result = page_mapfile(reg, va, pte);
+		else if (*pte == 0 && filebytes > 0)
+			result = page_fillpart(as, reg, va, pte, filebytes);
+		else if (*pte & PTE_SWAPPED)
+			result = page_fill(as, va, pte);
+		else
+			result = 0;
+		if (result)
+			break;
+		if (fetch)
+			VMSTAT_INC(vs_prefetches);
+		if (!tlb_preload(as, reg, va, writeable, sharedwrite))
+			break;
+	}
+	return va;
 }
 
+/**
+ * TLB miss handler.
+ *
+ * Checks that the address belongs to the current address space and
+ * that its region allows the access, finds its PTE in O(1) through
+ * the two-level page table and, if the page is not resident, gives it
+ * a frame: the shared zero page while it has only been read, a
+ * zero-filled page of its own once it is written, or the page read
+ * back from swap if it was evicted. Then loads the translation into
+ * the TLB.
+ *
+ * Frames shared copy-on-write after fork, and clean pages that still
+ * have a copy in swap, are mapped read-only. The first write to one
+ * traps here as VM_FAULT_READONLY (or as a plain write miss); a shared
+ * frame gets a private copy, and a clean page becomes dirty and gives
+ * up its swap slot.
+ *
+ * Pages of a file mapping come from the page cache. A MAP_SHARED one
+ * maps the cached page itself, and writes to it mark it dirty for
+ * writeback; a MAP_PRIVATE one is copied on its first write, like a
+ * frame shared after fork. Program regions are private mappings of
+ * the executable, so exec reads nothing until it is used; only the
+ * page where a segment's part in the file ends gets a copy of its own
+ * straight away, so that the zero-filled part is zeroes.
+ *
+ * Faults are costly, so each one also loads the resident pages around
+ * it (fault_around) and, during a run of faults on consecutive pages,
+ * reads in the pages coming next (prefetch_ahead).
+ */
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	lock_acquire(lock_coremap);
+	struct addrspace *as;
+	struct region *reg;
+	struct page *p = NULL;
+	pte_t *pte;
+	vaddr_t next;
+	size_t filebytes;
+	uint32_t ehi, elo;
+	bool writeable, sharedwrite;
+	int spl, idx, result;
+
+	faultaddress &= PAGE_FRAME;
+
+	switch (faulttype)
+	{
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	as = curthread->t_addrspace;
+	if (as == NULL)
+	{
+		/* Kernel fault early in boot, or no process at all */
+		return EFAULT;
+	}
+
+	/* Regions have permissions; the heap and stack are read-write */
+	reg = as_find_region(as, faultaddress);
+	if (reg == NULL && !as_valid_addr(as, faultaddress))
+		return EFAULT;
+	writeable = reg == NULL || (reg->prot & PROT_WRITE) || as->loading;
+	if (reg != NULL && reg->prot == PROT_NONE && !as->loading)
+		return EFAULT;
+	if (faulttype != VM_FAULT_READ && !writeable)
+		return EFAULT;
+
+	/* Writes to a shared file page go to the page cache page itself */
+	filebytes = region_filebytes(reg, faultaddress);
+	sharedwrite = filebytes > 0 && reg->shared && writeable;
+
+	pte = pt_lookup(as->table, faultaddress, true);
+	if (pte == NULL)
+		return ENOMEM;
+
+	spinlock_acquire(&coremap_lock);
+	switch (faulttype)
+	{
+	    case VM_FAULT_READ:
+		VMSTAT_INC(vs_faults_read);
+		break;
+	    case VM_FAULT_WRITE:
+		VMSTAT_INC(vs_faults_write);
+		break;
+	    case VM_FAULT_READONLY:
+		VMSTAT_INC(vs_faults_readonly);
+		break;
+	}
+	for (;;)
+	{
+		if (*pte == 0 && filebytes == PAGE_SIZE)
+		{
+			/* Never touched, or dropped by eviction */
+			result = page_mapfile(reg, faultaddress, pte);
+		}
+		else if (*pte == 0 && filebytes > 0)
+		{
+			/* Partly in the file, partly zero-filled */
+			result = page_fillpart(as, reg, faultaddress, pte,
+					       filebytes);
+		}
+		else if (*pte == 0 && faulttype == VM_FAULT_READ)
+		{
+			/* Only read so far: it is all zeroes */
+			*pte = (KVADDR_TO_PADDR(zero_page->virtual_addr) & PTE_FRAME) |
+				PTE_VALID;
+			VMSTAT_INC(vs_zeromaps);
+			continue;
+		}
+		else if (!(*pte & PTE_VALID))
+		{
+			/* Never touched, or swapped out */
+			result = page_fill(as, faultaddress, pte);
+		}
+		else
+		{
+			p = paddr_to_page(*pte & PTE_FRAME);
+			if (p->busy)
+			{
+				page_wait();
+				continue;
+			}
+			if (faulttype == VM_FAULT_READ || p->refcount == 1)
+				break;
+			if (p->vnode != NULL && sharedwrite)
+				break;
+			if (p == zero_page)
+			{
+				/* First write to a page only read before */
+				result = page_fill(as, faultaddress, pte);
+			}
+			else
+			{
+				/* Write to a page still shared with a fork */
+				result = page_unshare(as, faultaddress, pte);
+			}
+		}
+		if (result)
+		{
+			spinlock_release(&coremap_lock);
+			return result;
+		}
+	}
+
+	/*
+	 * The page is resident, nobody is paging it, and if this is a
+	 * write it is ours alone (or a shared file page). Claim it if
+	 * sharing left it without an owner, and mark it used for the
+	 * clock.
+	 */
+	if (page_mappers(p) == 1 && p->addrspce == NULL)
+	{
+		p->addrspce = as;
+		p->user_vaddr = faultaddress;
+	}
+	p->referenced = true;
+	if (faulttype != VM_FAULT_READ && p->page_state == CLEAN)
+	{
+		/* The copy in swap, or in the file, is about to go stale */
+		if (p->swap_slot != SWAP_NOSLOT)
+		{
+			swap_free(p->swap_slot);
+			p->swap_slot = SWAP_NOSLOT;
+		}
+		p->page_state = DIRTY;
+	}
+
+	ehi = faultaddress | (as->asid << TLBHI_PIDSHIFT);
+	elo = (*pte & PTE_FRAME) | TLBLO_VALID;
+	if (tlb_writeable(p, writeable, sharedwrite))
+		elo |= TLBLO_DIRTY;
+
+	/*
+	 * Still under coremap_lock: an eviction of this page can only
+	 * start after the entry is in, so its shootdown will remove it.
+	 */
+	spl = splhigh();
+	idx = tlb_probe(ehi, 0);
+	if (idx >= 0)
+		tlb_write(ehi, elo, idx);
+	else
+		tlb_random(ehi, elo);
+	splx(spl);
+	VMSTAT_INC(vs_tlb_refills);
+
+	/*
+	 * A fault on the page the last one left off at continues a run;
+	 * the pages loaded ahead count as touched, or prefetching would
+	 * break the run it is for.
+	 */
+	if (faultaddress == as->seqnext)
+		as->seqrun++;
+	else
+		as->seqrun = 0;
+	next = fault_around(as, reg, faultaddress, writeable, sharedwrite);
+	if (as->seqrun >= PREFETCH_RUN && prefetch > 0)
+		next = prefetch_ahead(as, reg, faultaddress, next, writeable,
+				      sharedwrite);
+	as->seqnext = next;
+	spinlock_release(&coremap_lock);
+
+	return 0;
+}
+
+/**
+ * Give as the next ASID, starting a new generation if they have run
+ * out. Caller must hold asid_lock.
+ */
+static
+void
+asid_assign(struct addrspace *as)
+{
+	KASSERT(spinlock_do_i_hold(&asid_lock));
+
+	if (asid_next == NUM_ASID)
+	{
+		asid_generation++;
+		asid_next = 1;
+	}
+	as->asid = asid_next++;
+	as->asid_generation = asid_generation;
+	as->asid_cpu = curcpu->c_self;
+}
+
+/**
+ * Make as the address space the MMU translates for on this CPU.
+ *
+ * An address space keeps its ASID for as long as it stays on one CPU,
+ * so a switch back to it finds its entries still in the TLB. If it
+ * moves, it gets a new ASID on the new CPU: whatever translations it
+ * left behind on the old one can then never match again, and need no
+ * shootdown. A CPU whose TLB is from an old generation of ASIDs
+ * flushes it before loading one from the current generation.
+ */
+void
+vm_activate(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+
+	if (as->asid_generation != asid_generation ||
+	    as->asid_cpu != curcpu->c_self)
+		asid_assign(as);
+
+	if (curcpu->c_asid_generation != asid_generation || !asids_enabled)
+	{
+		curcpu->c_asid_generation = asid_generation;
+		vm_tlbshootdown_all();
+	}
+
+	curcpu->c_asid = as->asid;
+	tlb_setasid(as->asid);
+
+	spinlock_release(&asid_lock);
+}
+
+/**
+ * Drop every translation of as, on every CPU, by moving it to a new
+ * ASID; entries tagged with the old one never match again.
+ */
+void
+vm_tlbflush(struct addrspace *as)
+{
+	spinlock_acquire(&asid_lock);
+	asid_assign(as);
+	if (curthread->t_addrspace == as)
+	{
+		if (curcpu->c_asid_generation != asid_generation)
+		{
+			curcpu->c_asid_generation = asid_generation;
+			vm_tlbshootdown_all();
+		}
+		curcpu->c_asid = as->asid;
+		tlb_setasid(as->asid);
+	}
+	spinlock_release(&asid_lock);
+}
+
+uint32_t
+vm_tlbrefills(void)
+{
+	uint32_t refills = 0;
+	unsigned c;
+
+	spinlock_acquire(&coremap_lock);
+	for (c = 0; c < VMSTAT_MAXCPUS; c++)
+		refills += vm_cpustats[c].vs_tlb_refills;
+	spinlock_release(&coremap_lock);
+	return refills;
+}
+
+/*
+ * Add up the per-CPU counters, and count the pages in each state by
+ * walking the coremap. Pages in the zero pool are counted as zeroed
+ * only, not free.
+ */
+void
+vm_getstats(struct vmstats *st)
+{
+	const struct vmstats *cs;
+	unsigned c;
+	uint32_t i;
+
+	bzero(st, sizeof(*st));
+
+	spinlock_acquire(&coremap_lock);
+	for (c = 0; c < VMSTAT_MAXCPUS; c++)
+	{
+		cs = &vm_cpustats[c];
+		st->vs_faults_read += cs->vs_faults_read;
+		st->vs_faults_write += cs->vs_faults_write;
+		st->vs_faults_readonly += cs->vs_faults_readonly;
+		st->vs_tlb_refills += cs->vs_tlb_refills;
+		st->vs_tlb_preloads += cs->vs_tlb_preloads;
+		st->vs_zerofills += cs->vs_zerofills;
+		st->vs_zeromaps += cs->vs_zeromaps;
+		st->vs_cowcopies += cs->vs_cowcopies;
+		st->vs_pcache_hits += cs->vs_pcache_hits;
+		st->vs_pcache_misses += cs->vs_pcache_misses;
+		st->vs_prefetches += cs->vs_prefetches;
+		st->vs_evictions += cs->vs_evictions;
+		st->vs_swapins += cs->vs_swapins;
+		st->vs_swapouts += cs->vs_swapouts;
+	}
+
+	st->vs_pages_total = page_num;
+	for (i = 0; i < page_num; i++)
+	{
+		switch (pages[i].page_state)
+		{
+		    case FREE:
+			st->vs_pages_free++;
+			break;
+		    case FIXED:
+			st->vs_pages_fixed++;
+			break;
+		    case DIRTY:
+			st->vs_pages_dirty++;
+			break;
+		    case CLEAN:
+			st->vs_pages_clean++;
+			break;
+		    case ZEROED:
+			st->vs_pages_zeroed++;
+			break;
+		}
+	}
+	st->vs_pages_cached = pcache_count;
+	spinlock_release(&coremap_lock);
+}
+
+void
+vm_printstats(void)
+{
+	struct vmstats st;
+
+	vm_getstats(&st);
+
+	kprintf("Pages: %u total, %u free, %u zeroed, %u fixed, "
+		"%u dirty, %u clean, %u cached\n",
+		st.vs_pages_total, st.vs_pages_free, st.vs_pages_zeroed,
+		st.vs_pages_fixed, st.vs_pages_dirty, st.vs_pages_clean,
+		st.vs_pages_cached);
+	kprintf("Faults: %u read, %u write, %u read-only\n",
+		st.vs_faults_read, st.vs_faults_write,
+		st.vs_faults_readonly);
+	kprintf("TLB: %u refills, %u preloaded\n",
+		st.vs_tlb_refills, st.vs_tlb_preloads);
+	kprintf("Fills: %u zero-filled, %u zero page, %u copied on write, "
+		"%u prefetched\n",
+		st.vs_zerofills, st.vs_zeromaps, st.vs_cowcopies,
+		st.vs_prefetches);
+	kprintf("Page cache: %u hits, %u misses\n",
+		st.vs_pcache_hits, st.vs_pcache_misses);
+	kprintf("Paging: %u evicted, %u swapped in, %u swapped out\n",
+		st.vs_evictions, st.vs_swapins, st.vs_swapouts);
+}
+
+void
+vm_setasids(bool enable)
+{
+	spinlock_acquire(&asid_lock);
+	asids_enabled = enable;
+	spinlock_release(&asid_lock);
+}
 
-	/* TODO */
+void
+vm_setfaultaround(unsigned around, unsigned ahead)
+{
+	unsigned window;
+
+	/* The window is aligned, so it has to be a power of two */
+	if (around > FAULTAROUND_MAX)
+		around = FAULTAROUND_MAX;
+	for (window = 1; window * 2 <= around; window *= 2)
+		;
+	if (ahead > PREFETCH_MAX)
+		ahead = PREFETCH_MAX;
+
+	spinlock_acquire(&coremap_lock);
+	faultaround = window;
+	prefetch = ahead;
+	spinlock_release(&coremap_lock);
+}
 
-	lock_release(lock_coremap);
-	(void) faulttype;
-	(void) faultaddress;
-	return EUNIMP;
+void
+vm_getfaultaround(unsigned *around, unsigned *ahead)
+{
+	spinlock_acquire(&coremap_lock);
+	*around = faultaround;
+	*ahead = prefetch;
+	spinlock_release(&coremap_lock);
 }
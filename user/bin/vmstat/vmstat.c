@@ -0,0 +1,97 @@
+/*
+ * vmstat.c
+ *
+ *	Print virtual memory statistics.
+ *	Usage: vmstat [program [arguments]]
+ *
+ * With no arguments, prints how many pages are in each state and the
+ * VM event counters since boot. Given a program, runs it and prints
+ * the events that happened while it ran instead (along with anything
+ * else that was running at the time).
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/wait.h>
+#include <sys/vmstat.h>
+
+static
+void
+printstats(const struct vmstats *st)
+{
+	printf("Pages: %u total, %u free, %u zeroed, %u fixed, "
+	       "%u dirty, %u clean, %u cached\n",
+	       st->vs_pages_total, st->vs_pages_free, st->vs_pages_zeroed,
+	       st->vs_pages_fixed, st->vs_pages_dirty, st->vs_pages_clean,
+	       st->vs_pages_cached);
+	printf("Faults: %u read, %u write, %u read-only\n",
+	       st->vs_faults_read, st->vs_faults_write,
+	       st->vs_faults_readonly);
+	printf("TLB: %u refills, %u preloaded\n",
+	       st->vs_tlb_refills, st->vs_tlb_preloads);
+	printf("Fills: %u zero-filled, %u zero page, %u copied on write, "
+	       "%u prefetched\n",
+	       st->vs_zerofills, st->vs_zeromaps, st->vs_cowcopies,
+	       st->vs_prefetches);
+	printf("Page cache: %u hits, %u misses\n",
+	       st->vs_pcache_hits, st->vs_pcache_misses);
+	printf("Paging: %u evicted, %u swapped in, %u swapped out\n",
+	       st->vs_evictions, st->vs_swapins, st->vs_swapouts);
+}
+
+/* Turn the counters in AFTER into what happened since BEFORE */
+static
+void
+subtract(struct vmstats *after, const struct vmstats *before)
+{
+	after->vs_faults_read -= before->vs_faults_read;
+	after->vs_faults_write -= before->vs_faults_write;
+	after->vs_faults_readonly -= before->vs_faults_readonly;
+	after->vs_tlb_refills -= before->vs_tlb_refills;
+	after->vs_tlb_preloads -= before->vs_tlb_preloads;
+	after->vs_zerofills -= before->vs_zerofills;
+	after->vs_zeromaps -= before->vs_zeromaps;
+	after->vs_cowcopies -= before->vs_cowcopies;
+	after->vs_pcache_hits -= before->vs_pcache_hits;
+	after->vs_pcache_misses -= before->vs_pcache_misses;
+	after->vs_prefetches -= before->vs_prefetches;
+	after->vs_evictions -= before->vs_evictions;
+	after->vs_swapins -= before->vs_swapins;
+	after->vs_swapouts -= before->vs_swapouts;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct vmstats before, after;
+	pid_t pid;
+	int status;
+
+	if (vmstat(&before) < 0) {
+		err(1, "vmstat");
+	}
+	if (argc < 2) {
+		printstats(&before);
+		return 0;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv(argv[1], &argv[1]);
+		err(1, "%s", argv[1]);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+
+	if (vmstat(&after) < 0) {
+		err(1, "vmstat");
+	}
+	subtract(&after, &before);
+	printstats(&after);
+	return 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * mman.h
+ *
+ *	Memory-mapped files.
+ */
+
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/* Get the PROT_, MAP_ and MS_ constants from the kernel */
+#include <kern/mman.h>
+
+/* What mmap returns on failure */
+#define MAP_FAILED ((void *)-1)
+
+/*
+ * mmap maps LEN bytes of the open file FD, starting at OFFSET (a
+ * multiple of the page size), somewhere in the address space and
+ * returns where; ADDR is ignored. munmap removes the mappings in a
+ * range and msync writes back what a MAP_SHARED mapping changed.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,21 @@
+/*
+ * vmstat.h
+ *
+ *	Virtual memory statistics.
+ */
+
+#ifndef _SYS_VMSTAT_H_
+#define _SYS_VMSTAT_H_
+
+#include <sys/types.h>
+
+/* Get struct vmstats from the kernel */
+#include <kern/vmstat.h>
+
+/*
+ * vmstat fills in BUF with the kernel's VM event counters since boot
+ * and how many physical pages are in each state right now.
+ */
+int vmstat(struct vmstats *buf);
+
+#endif /* _SYS_VMSTAT_H_ */
@@ -30,10 +30,10 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator: free blocks are kept on lists by
+ * size, so malloc and free do not walk the heap. Adjacent free blocks
+ * are merged, as before, using the sizes in the block headers. See
+ * design/usermalloc.txt.
  */
 
 #include <stdlib.h>
@@ -136,9 +136,48 @@ struct mheader {
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Free blocks are kept on doubly-linked lists ("bins") by size,
+ * threaded through their data area, which is always at least
+ * MBLOCKSIZE bytes - room for the two pointers.
+ *
+ * The first NSMALLBINS bins each hold one size: MBLOCKSIZE,
+ * 2*MBLOCKSIZE, and so on. Each bin after that holds sizes up to
+ * twice those of the one before it; the last bin holds everything
+ * bigger. __binmap has a bit set for every bin that is not empty, so
+ * finding a bin with blocks big enough does not mean looking at every
+ * empty one.
+ */
+
+struct mfree {
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
+};
+
+#define M_FREE(mh)	((struct mfree *)M_DATA(mh))
+#define M_HEADER(mf)	(((struct mheader *)(mf))-1)
+
+#define NSMALLBINS	64
+#define NBINS		(NSMALLBINS + 24)
+#define BINMAPBITS	32
+#define BINMAPWORDS	((NBINS + BINMAPBITS - 1) / BINMAPBITS)
+
+/*
+ * A free block at the top of the heap at least this big is given back
+ * to the system with sbrk.
+ */
+#define MTRIMSIZE	(128*1024)
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Static variables - the bottom and top addresses of the heap, the
+ * block just below the top (NULL if there are no blocks), and the
+ * bins.
  */
 static uintptr_t __heapbase, __heaptop;
+static struct mheader *__heaplast;
+static struct mfree *__bins[NBINS];
+static uint32_t __binmap[BINMAPWORDS];
 
 /*
  * Setup function.
@@ -161,6 +200,9 @@ __malloc_init(void)
 	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
 		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
 	}
+	if (sizeof(struct mfree) > MBLOCKSIZE) {
+		errx(1, "malloc: Internal error - free list links too big");
+	}
 
 	/* init should only be called once. */
 	if (__heapbase!=0 || __heaptop!=0) {
@@ -179,7 +221,7 @@ __malloc_init(void)
 
 	/*
 	 * Make sure the heap base is aligned the way we want it.
-	 * (On OS/161, it will begin on a page boundary. But on 
+	 * (On OS/161, it will begin on a page boundary. But on
 	 * an arbitrary Unix, it may not be, as traditionally it
 	 * begins at _end.)
 	 */
@@ -231,7 +273,7 @@ __malloc_dump(void)
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
 			     " has bad previous-block size %lu "
 			     "(should be %lu)",
-			     (unsigned long) i, 
+			     (unsigned long) i,
 			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
 			     (unsigned long) rightprevblock << MBLOCKSHIFT);
 		}
@@ -255,7 +297,125 @@ __malloc_dump(void)
 ////////////////////////////////////////////////////////////
 
 /*
- * Get more memory (at the top of the heap) using sbrk, and 
+ * Clear a range of memory with 0xdeadbeef.
+ * ptr must be suitably aligned.
+ */
+static
+void
+__malloc_deadbeef(void *ptr, size_t size)
+{
+	uint32_t *x = ptr;
+	size_t i, n = size/sizeof(uint32_t);
+	for (i=0; i<n; i++) {
+		x[i] = 0xdeadbeef;
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Which bin a free block with size bytes of data goes in.
+ */
+static
+unsigned
+__malloc_bin(size_t size)
+{
+	unsigned bin;
+
+	if (size <= NSMALLBINS*MBLOCKSIZE) {
+		return size/MBLOCKSIZE - 1;
+	}
+
+	/* NSMALLBINS is 64: 2^6 */
+	size >>= MBLOCKSHIFT + 6;
+	for (bin = NSMALLBINS; size > 1 && bin < NBINS-1; bin++) {
+		size >>= 1;
+	}
+	return bin;
+}
+
+/*
+ * Return the first bin at or above bin that has any blocks in it,
+ * or NBINS if there is none.
+ */
+static
+unsigned
+__malloc_findbin(unsigned bin)
+{
+	unsigned word;
+	uint32_t bits;
+
+	for (word = bin / BINMAPBITS; word < BINMAPWORDS; word++) {
+		bits = __binmap[word];
+		if (word == bin / BINMAPBITS) {
+			/* skip the bins below the one asked for */
+			bits &= ~(uint32_t)0 << (bin % BINMAPBITS);
+		}
+		if (bits == 0) {
+			continue;
+		}
+		bin = word * BINMAPBITS;
+		while ((bits & 1) == 0) {
+			bits >>= 1;
+			bin++;
+		}
+		return bin;
+	}
+	return NBINS;
+}
+
+/*
+ * Put a free block on its bin.
+ */
+static
+void
+__malloc_binadd(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned bin = __malloc_bin(M_SIZE(mh));
+
+	mf->mf_prev = NULL;
+	mf->mf_next = __bins[bin];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__bins[bin] = mf;
+	__binmap[bin / BINMAPBITS] |= (uint32_t)1 << (bin % BINMAPBITS);
+}
+
+/*
+ * Take a free block off its bin.
+ */
+static
+void
+__malloc_binremove(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+	unsigned bin = __malloc_bin(M_SIZE(mh));
+
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		if (__bins[bin] != mf) {
+			errx(1, "malloc: Heap corrupt; free block at %p "
+			     "not on its bin", mh);
+		}
+		__bins[bin] = mf->mf_next;
+		if (__bins[bin] == NULL) {
+			__binmap[bin / BINMAPBITS] &=
+				~((uint32_t)1 << (bin % BINMAPBITS));
+		}
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Get more memory (at the top of the heap) using sbrk, and
  * return a pointer to it.
  */
 static
@@ -279,10 +439,45 @@ __malloc_sbrk(size_t size)
 	return x;
 }
 
+/*
+ * Attempt to merge two adjacent blocks (mh below mhnext). Both must be
+ * off their bins.
+ */
+static
+void
+__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
+{
+	struct mheader *mhnextnext;
+
+	if (mh->mh_nextblock != mhnext->mh_prevblock) {
+		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
+		     mh, mhnext);
+	}
+	if (mh->mh_inuse || mhnext->mh_inuse) {
+		/* can't merge */
+		return;
+	}
+
+	mhnextnext = M_NEXT(mhnext);
+
+	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
+				     MBLOCKSIZE + M_SIZE(mhnext));
+
+	if (mhnextnext != (struct mheader *)__heaptop) {
+		mhnextnext->mh_prevblock = mh->mh_nextblock;
+	}
+	else {
+		__heaplast = mh;
+	}
+
+	/* Deadbeef out the memory used by the now-obsolete header */
+	__malloc_deadbeef(mhnext, sizeof(struct mheader));
+}
+
 /*
  * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
+ * bytes for data in the current block, and put it on its bin. size
+ * must be a multiple of MBLOCKSIZE.
  *
  * Only split if the excess space is at least twice the blocksize -
  * one blocksize to hold a header and one for data.
@@ -308,7 +503,7 @@ __malloc_split(struct mheader *mh, size_t size)
 
 	oldsize = M_SIZE(mh);
 	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
-	
+
 	mhnew = M_NEXT(mh);
 	if (mhnew==mhnext) {
 		errx(1, "malloc: Internal error (split screwed up?)");
@@ -323,9 +518,48 @@ __malloc_split(struct mheader *mh, size_t size)
 
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
+		/* the block above may be free too (see malloc) */
+		if (!mhnext->mh_inuse) {
+			__malloc_binremove(mhnext);
+			__malloc_trymerge(mhnew, mhnext);
+		}
+	}
+	else {
+		__heaplast = mhnew;
+	}
+
+	__malloc_binadd(mhnew);
+}
+
+/*
+ * Take the block above the top of the heap away from the heap, giving
+ * its memory back, if it is free and big.
+ */
+static
+void
+__malloc_trim(void)
+{
+	struct mheader *mh = __heaplast;
+	size_t size;
+
+	if (mh == NULL || mh->mh_inuse || M_SIZE(mh) < MTRIMSIZE) {
+		return;
 	}
+
+	size = M_NEXTOFF(mh);
+	__malloc_binremove(mh);
+	__heaplast = (mh == (struct mheader *)__heapbase) ? NULL : M_PREV(mh);
+	if (sbrk(-(intptr_t)size) == (void *)-1) {
+		/* Keep it, then */
+		__heaplast = mh;
+		__malloc_binadd(mh);
+		return;
+	}
+	__heaptop -= size;
 }
 
+////////////////////////////////////////////////////////////
+
 /*
  * malloc itself.
  */
@@ -333,92 +567,95 @@ void *
 malloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mfree *mf;
+	unsigned bin;
+	size_t more;
 
 	if (__heapbase==0) {
 		__malloc_init();
 	}
 	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
 		warnx("malloc: Internal error - local data corrupt");
-		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx", 
+		errx(1, "malloc: heapbase 0x%lx; heaptop 0x%lx",
 		     (unsigned long) __heapbase, (unsigned long) __heaptop);
 	}
 
 #ifdef MALLOCDEBUG
-	warnx("malloc: about to allocate %lu (0x%lx) bytes", 
+	warnx("malloc: about to allocate %lu (0x%lx) bytes",
 	      (unsigned long) size, (unsigned long) size);
 	__malloc_dump();
 #endif
 
-	/* Round size up to an integral number of blocks. */
+	/*
+	 * Round size up to an integral number of blocks, and to at least
+	 * one, so the block can hold free list links once it is freed.
+	 */
 	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		size = MBLOCKSIZE;
+	}
 
 	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
+	 * Look in the bin for this size first. The blocks in a small bin
+	 * are all exactly this size; those in a bigger bin may be smaller
+	 * than what we want, so check. Failing that, the first block of
+	 * any bin above is big enough.
 	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
+	mh = NULL;
+	bin = __malloc_bin(size);
+	for (mf = __bins[bin]; mf != NULL; mf = mf->mf_next) {
+		if (M_SIZE(M_HEADER(mf)) >= size) {
+			mh = M_HEADER(mf);
+			break;
 		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
+	}
+	if (mh == NULL) {
+		bin = __malloc_findbin(bin + 1);
+		if (bin < NBINS) {
+			mh = M_HEADER(__bins[bin]);
 		}
+	}
 
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
+	if (mh != NULL) {
+		if (!M_OK(mh) || mh->mh_inuse) {
+			errx(1, "malloc: Heap corrupt; bad free block at %p",
+			     mh);
 		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
+		__malloc_binremove(mh);
+	}
+	else if (__heaplast != NULL && !__heaplast->mh_inuse) {
 		/*
-		 * Now, allocate.
+		 * Nothing big enough, but the block at the top of the heap
+		 * is free: grow the heap by just what it is missing.
 		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
-	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+		mh = __heaplast;
+		more = size - M_SIZE(mh);
+		if (__malloc_sbrk(more) == NULL) {
+			return NULL;
+		}
+		__malloc_binremove(mh);
+		mh->mh_nextblock = M_MKFIELD(M_NEXTOFF(mh) + more);
 	}
+	else {
+		/*
+		 * Expand the heap by a whole new block.
+		 */
+		mh = __malloc_sbrk(size + MBLOCKSIZE);
+		if (mh == NULL) {
+			return NULL;
+		}
 
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
-
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
-	if (mh == NULL) {
-		return NULL;
+		mh->mh_prevblock = __heaplast ? __heaplast->mh_nextblock : 0;
+		mh->mh_magic1 = MMAGIC;
+		mh->mh_magic2 = MMAGIC;
+		mh->mh_pad = 0;
+		mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+		__heaplast = mh;
 	}
 
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
+	/* Give back what we don't need, then allocate. */
+	__malloc_split(mh, size);
 	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -429,52 +666,6 @@ malloc(size_t size)
 
 ////////////////////////////////////////////////////////////
 
-/*
- * Clear a range of memory with 0xdeadbeef.
- * ptr must be suitably aligned.
- */
-static
-void
-__malloc_deadbeef(void *ptr, size_t size)
-{
-	uint32_t *x = ptr;
-	size_t i, n = size/sizeof(uint32_t);
-	for (i=0; i<n; i++) {
-		x[i] = 0xdeadbeef;
-	}
-}
-
-/*
- * Attempt to merge two adjacent blocks (mh below mhnext).
- */
-static
-void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
-{
-	struct mheader *mhnextnext;
-
-	if (mh->mh_nextblock != mhnext->mh_prevblock) {
-		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
-		     mh, mhnext);
-	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
-
-	mhnextnext = M_NEXT(mhnext);
-
-	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
-				     MBLOCKSIZE + M_SIZE(mhnext));
-
-	if (mhnextnext != (struct mheader *)__heaptop) {
-		mhnextnext->mh_prevblock = mh->mh_nextblock;
-	}
-
-	/* Deadbeef out the memory used by the now-obsolete header */
-	__malloc_deadbeef(mhnext, sizeof(struct mheader));
-}
-
 /*
  * The actual free() implementation.
  */
@@ -491,7 +682,7 @@ free(void *x)
 	/* Consistency check. */
 	if (__heapbase==0 || __heaptop==0 || __heapbase > __heaptop) {
 		warnx("free: Internal error - local data corrupt");
-		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx", 
+		errx(1, "free: heapbase 0x%lx; heaptop 0x%lx",
 		     (unsigned long) __heapbase, (unsigned long) __heaptop);
 	}
 
@@ -517,21 +708,34 @@ free(void *x)
 	/* mark it free */
 	mh->mh_inuse = 0;
 
-	/* wipe it */
+#ifdef MALLOCDEBUG
+	/*
+	 * wipe it (only when debugging: it would touch every page of a
+	 * big block, even ones the program never used)
+	 */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
+#endif
 
 	/* Try merging with the block above (but not if we're at the top) */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
+	if (mhnext != (struct mheader *)__heaptop && !mhnext->mh_inuse) {
+		__malloc_binremove(mhnext);
 		__malloc_trymerge(mh, mhnext);
 	}
 
 	/* Try merging with the block below (but not if we're at the bottom) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			__malloc_binremove(mhprev);
+			__malloc_trymerge(mhprev, mh);
+			mh = mhprev;
+		}
 	}
 
+	__malloc_binadd(mh);
+	__malloc_trim();
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
 	__malloc_dump();
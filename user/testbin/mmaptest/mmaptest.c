@@ -0,0 +1,162 @@
+/*
+ * mmaptest.c
+ *
+ *	Tests mmap, msync and munmap on a file.
+ *	Usage: mmaptest [file]
+ *
+ * The file is created (or overwritten) with write(), changed through a
+ * MAP_SHARED mapping and read back with read(); then a MAP_PRIVATE
+ * mapping is changed, which must leave the file alone. The file has to
+ * be on a file system that supports mmap (SFS).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+#include <sys/mman.h>
+
+#define NPAGES   8
+#define PAGESIZE 4096
+#define FILESIZE (NPAGES * PAGESIZE - 100)	/* last page is partial */
+
+static char buf[NPAGES * PAGESIZE];
+
+/* What byte I of the file should hold after ROUND rounds of changes */
+static
+char
+expect(int i, int round)
+{
+	return (char)('a' + (i / PAGESIZE + i + round) % 26);
+}
+
+static
+void
+fill(const char *path)
+{
+	int fd, i;
+
+	for (i=0; i<FILESIZE; i++) {
+		buf[i] = expect(i, 0);
+	}
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s: open for write", path);
+	}
+	if (write(fd, buf, FILESIZE) != FILESIZE) {
+		err(1, "%s: write", path);
+	}
+	close(fd);
+}
+
+static
+void
+check(const char *path, int round)
+{
+	int fd, i, len;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open for read", path);
+	}
+	len = read(fd, buf, sizeof(buf));
+	if (len != FILESIZE) {
+		errx(1, "%s: read %d bytes, expected %d", path, len, FILESIZE);
+	}
+	close(fd);
+
+	for (i=0; i<FILESIZE; i++) {
+		if (buf[i] != expect(i, round)) {
+			errx(1, "%s: byte %d is %c, expected %c", path, i,
+			     buf[i], expect(i, round));
+		}
+	}
+}
+
+static
+char *
+map(int fd, int flags)
+{
+	char *p;
+	int i;
+
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != expect(i, 1)) {
+			errx(1, "mapping: byte %d is %c, expected %c", i,
+			     p[i], expect(i, 1));
+		}
+	}
+	/* The rest of the last page reads as zeroes */
+	for (i=FILESIZE; i<NPAGES * PAGESIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "mapping: byte %d past EOF is not zero", i);
+		}
+	}
+	return p;
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *path = "mmaptest.dat";
+	char *p;
+	int fd, i;
+
+	if (argc > 1) {
+		path = argv[1];
+	}
+
+	fill(path);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", path);
+	}
+
+	printf("Shared mapping...\n");
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	for (i=0; i<FILESIZE; i++) {
+		if (p[i] != expect(i, 0)) {
+			errx(1, "mapping: byte %d is %c, expected %c", i,
+			     p[i], expect(i, 0));
+		}
+		p[i] = expect(i, 1);
+	}
+	if (msync(p, FILESIZE, MS_SYNC)) {
+		err(1, "msync");
+	}
+	check(path, 1);
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+
+	printf("Private mapping...\n");
+	p = map(fd, MAP_PRIVATE);
+	for (i=0; i<FILESIZE; i++) {
+		p[i] = expect(i, 2);
+	}
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+	check(path, 1);
+
+	printf("Mapping again...\n");
+	p = map(fd, MAP_SHARED);
+	if (munmap(p, FILESIZE)) {
+		err(1, "munmap");
+	}
+
+	close(fd);
+	remove(path);
+
+	printf("Passed mmaptest.\n");
+	return 0;
+}
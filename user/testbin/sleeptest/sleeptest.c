@@ -0,0 +1,109 @@
+/*
+ * sleeptest.c
+ *
+ *	Tests nanosleep.
+ *	Usage: sleeptest
+ *
+ * Each sleep has to last at least as long as asked for, and leave
+ * nothing remaining; bad requests have to fail with EINVAL without
+ * sleeping.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define NSEC_PER_SEC 1000000000L
+
+static const struct timespec goodreqs[] = {
+	{ 0, 0 },
+	{ 0, 1 },
+	{ 0, 10000000 },		/* 10 ms, about one tick */
+	{ 0, 250000000 },
+	{ 0, NSEC_PER_SEC - 1 },
+	{ 1, 0 },
+	{ 1, 500000000 },
+};
+
+static const struct timespec badreqs[] = {
+	{ -1, 0 },
+	{ 0, -1 },
+	{ 0, NSEC_PER_SEC },
+	{ 1, NSEC_PER_SEC + 1 },
+};
+
+#define NGOOD (sizeof(goodreqs) / sizeof(goodreqs[0]))
+#define NBAD (sizeof(badreqs) / sizeof(badreqs[0]))
+
+/* Nanoseconds from A to B */
+static
+long long
+elapsed(time_t asecs, unsigned long ansecs, time_t bsecs, unsigned long bnsecs)
+{
+	return (long long)(bsecs - asecs) * NSEC_PER_SEC +
+		(long long)bnsecs - (long long)ansecs;
+}
+
+int
+main(void)
+{
+	struct timespec rem;
+	time_t secs1, secs2;
+	unsigned long nsecs1, nsecs2;
+	long long want, took;
+	unsigned i;
+	int failures = 0;
+
+	for (i=0; i<NGOOD; i++) {
+		want = (long long)goodreqs[i].tv_sec * NSEC_PER_SEC +
+			goodreqs[i].tv_nsec;
+		rem.tv_sec = rem.tv_nsec = -1;
+
+		__time(&secs1, &nsecs1);
+		if (nanosleep(&goodreqs[i], &rem) < 0) {
+			err(1, "nanosleep of %lld ns", want);
+		}
+		__time(&secs2, &nsecs2);
+
+		took = elapsed(secs1, nsecs1, secs2, nsecs2);
+		printf("asked for %lld ns, slept %lld ns\n", want, took);
+		if (took < want) {
+			warnx("woke up %lld ns early", want - took);
+			failures++;
+		}
+		if (rem.tv_sec != 0 || rem.tv_nsec != 0) {
+			warnx("%lld.%09ld s remaining after a full sleep",
+			      (long long)rem.tv_sec, (long)rem.tv_nsec);
+			failures++;
+		}
+	}
+
+	for (i=0; i<NBAD; i++) {
+		__time(&secs1, &nsecs1);
+		errno = 0;
+		if (nanosleep(&badreqs[i], NULL) != -1 || errno != EINVAL) {
+			warnx("nanosleep of %lld s %ld ns: expected EINVAL, "
+			      "got %s", (long long)badreqs[i].tv_sec,
+			      (long)badreqs[i].tv_nsec,
+			      errno ? strerror(errno) : "success");
+			failures++;
+		}
+		__time(&secs2, &nsecs2);
+
+		/* It should not have slept at all; allow a tick or so */
+		took = elapsed(secs1, nsecs1, secs2, nsecs2);
+		if (took > NSEC_PER_SEC / 10) {
+			warnx("bad request slept %lld ns", took);
+			failures++;
+		}
+	}
+
+	if (failures > 0) {
+		errx(1, "%d failures", failures);
+	}
+	printf("sleeptest: passed\n");
+	return 0;
+}